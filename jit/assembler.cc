@@ -33,6 +33,8 @@
 // Copyright 2012 the V8 project authors. All rights reserved.
 // Copyright 2017 Google Inc. All rights reserved.
 
+#include <string.h>
+
 #include "jit/assembler.h"
 #include "jit/cpu.h"
 #include "jit/memory.h"
@@ -112,8 +114,22 @@ Operand::Operand(Label *label) : rex_(0), len_(1) {
   set_disp64(reinterpret_cast<intptr_t>(label));
 }
 
+Operand::Operand(const void *address) : rex_(0), len_(1) {
+  set_modrm(0, rbp);
+  set_disp64(reinterpret_cast<intptr_t>(address));
+  absolute_ = true;
+}
+
 Operand::Operand(const Operand &operand, int32_t offset) {
   // DCHECK(operand.len_ >= 1);
+  // Rip-relative operands hold the label or address instead of the
+  // displacement, so the offset is kept separately.
+  if (operand.buf_[0] == 5) {
+    *this = operand;
+    addend_ += offset;
+    return;
+  }
+
   // Operand encodes REX ModR/M [SIB] [Disp].
   byte modrm = operand.buf_[0];
   // DCHECK(modrm < 0xC0);  // Disallow mode 3 (register target).
@@ -157,9 +173,10 @@ Operand::Operand(const Operand &operand, int32_t offset) {
   }
 }
 
-Assembler::Assembler(void *buffer, int buffer_size)
-    : CodeGenerator(buffer, buffer_size) {
-  cpu_features_ = CPU::SupportedFeatures();
+Assembler::Assembler(void *buffer, int buffer_size, CpuFeatures features)
+    : CodeGenerator(buffer, buffer_size),
+      cpu_features_(features),
+      default_features_(features) {
 
 #ifdef DEBUG
   if (own_buffer_) {
@@ -168,14 +185,89 @@ Assembler::Assembler(void *buffer, int buffer_size)
 #endif
 }
 
-void Assembler::Align(int m) {
+Assembler::Assembler(CodeHeap *heap, CpuFeatures features)
+    : CodeGenerator(heap),
+      cpu_features_(features),
+      default_features_(features) {}
+
+void Assembler::Reset() {
+  CodeGenerator::Reset();
+  cpu_features_ = default_features_;
+  frame_ = {false, 8, 0};
+  frame_states_.clear();
+}
+
+// DWARF register numbers for registers.
+static const int kDwarfRegisters[] = {
+  0, 2, 1, 3, 7, 6, 4, 5, 8, 9, 10, 11, 12, 13, 14, 15,
+};
+
+// Check if register is preserved across calls.
+static bool IsCalleeSaved(Register reg) {
+  return reg.is(rbx) || reg.is(rbp) || reg.code() >= 12;
+}
+
+void Assembler::FrameAdjust(int delta) {
+  if (!unwind_info()) return;
+  frame_.stack += delta;
+  if (!frame_.rbp) {
+    AddFrameOp(kDefineCfa, kDwarfRegisters[rsp.code()], frame_.stack);
+  }
+}
+
+void Assembler::FrameSave(Register reg) {
+  if (!unwind_info() || !IsCalleeSaved(reg)) return;
+  AddFrameOp(kSaveRegister, kDwarfRegisters[reg.code()], frame_.stack);
+}
+
+void Assembler::FrameRestore(Register reg) {
+  if (!unwind_info() || !IsCalleeSaved(reg)) return;
+  if (reg.is(rbp) && frame_.rbp) {
+    // The CFA can no longer be computed from rbp when it is restored.
+    frame_.rbp = false;
+    AddFrameOp(kDefineCfa, kDwarfRegisters[rsp.code()], frame_.stack);
+  }
+  AddFrameOp(kRestoreRegister, kDwarfRegisters[reg.code()]);
+}
+
+void Assembler::FrameMove(Register dst, Register src) {
+  if (!unwind_info()) return;
+  if (dst.is(rbp) && src.is(rsp) && !frame_.rbp) {
+    // Set up frame pointer.
+    frame_.rbp = true;
+    frame_.frame = frame_.stack;
+    AddFrameOp(kDefineCfa, kDwarfRegisters[rbp.code()], frame_.frame);
+  } else if (dst.is(rsp) && src.is(rbp) && frame_.rbp) {
+    // Tear down frame.
+    frame_.rbp = false;
+    frame_.stack = frame_.frame;
+    AddFrameOp(kDefineCfa, kDwarfRegisters[rsp.code()], frame_.stack);
+  }
+}
+
+void Assembler::RememberFrameState() {
+  if (!unwind_info()) return;
+  frame_states_.push_back(frame_);
+  AddFrameOp(kRememberState);
+}
+
+void Assembler::RestoreFrameState() {
+  if (!unwind_info() || frame_states_.empty()) return;
+  frame_ = frame_states_.back();
+  frame_states_.pop_back();
+  AddFrameOp(kRestoreState);
+}
+
+void Assembler::Align(int m, int offset) {
   // DCHECK(IsPowerOfTwo32(m));
-  int delta = (m - (pc_offset() & (m - 1))) & (m - 1);
+  int delta = -(pc_offset() + offset) & (m - 1);
+  AddAlign(m, true, offset);
   Nop(delta);
 }
 
 void Assembler::DataAlign(int m) {
   // DCHECK(m >= 2 && IsPowerOfTwo32(m));
+  AddAlign(m, false);
   while ((pc_offset() & (m - 1)) != 0) {
     db(0);
   }
@@ -197,20 +289,19 @@ void Assembler::emit_operand(int code, const Operand &adr, int sl) {
   // Recognize RIP relative addressing.
   if (adr.buf_[0] == 5) {
     // DCHECK_EQ(9u, length);
-    // CHECK(sl == 0 || sl == 1);
-    Label *label = *bit_cast<Label *const *>(&adr.buf_[1]);
-    if (label->is_bound()) {
-      int offset = label->pos() - (pc_offset() + sl) - sizeof(int32_t);
-      // DCHECK_GE(0, offset);
-      emitl(offset);
-    } else if (label->is_linked()) {
-      emitl(sl == 1 ? -label->pos() : label->pos());
-      label->link_to(pc_offset() - sizeof(int32_t));
+    if (adr.absolute_) {
+      // Address outside the code buffer, which must be adjusted when the
+      // code is moved.
+      Address target = *bit_cast<Address const *>(&adr.buf_[1]);
+      target += adr.addend_;
+      AddRelative();
+      if (!shared_constants_.empty()) AddSharedReference(target, sl);
+      emitl(target - (origin_ + pc_offset() + sizeof(int32_t) + sl));
     } else {
-      // DCHECK(label->is_unused());
-      int32_t current = pc_offset();
-      emitl(sl == 1 ? -current : current);
-      label->link_to(current);
+      // The offset from the label is folded into the instruction bytes
+      // following the displacement.
+      Label *label = *bit_cast<Label *const *>(&adr.buf_[1]);
+      emitl(AddFixup(label, kRel32, sl - adr.addend_));
     }
   } else {
     // Emit the rest of the encoded operand.
@@ -560,19 +651,7 @@ void Assembler::call(Label *l) {
   EnsureSpace ensure_space(this);
   // 1110 1000 #32-bit disp.
   emit(0xE8);
-  if (l->is_bound()) {
-    int offset = l->pos() - pc_offset() - sizeof(int32_t);
-    // DCHECK(offset <= 0);
-    emitl(offset);
-  } else if (l->is_linked()) {
-    emitl(l->pos());
-    l->link_to(pc_offset() - sizeof(int32_t));
-  } else {
-    // DCHECK(l->is_unused());
-    int32_t current = pc_offset();
-    emitl(current);
-    l->link_to(current);
-  }
+  emitl(AddFixup(l, kRel32));
 }
 
 void Assembler::call(Register adr) {
@@ -591,20 +670,65 @@ void Assembler::call(const Operand &op) {
   emit_operand(0x2, op);
 }
 
-// Calls directly to the given address using a relative offset.
-// Should only ever be used in Code objects for calls within the
-// same Code object. Should not be used when generating new code (use labels),
-// but only when patching existing code.
 void Assembler::call(Address target) {
   EnsureSpace ensure_space(this);
   // 1110 1000 #32-bit disp.
   emit(0xE8);
-  Address source = pc_ + 4;
+  Address source = origin_ + pc_offset() + 4;
   intptr_t displacement = target - source;
   // DCHECK(is_int32(displacement));
+  AddRelative();
   emitl(static_cast<int32_t>(displacement));
 }
 
+void Assembler::call_extern(const void *target, const char *symbol) {
+  EnsureSpace ensure_space(this);
+  Address address = static_cast<Address>(const_cast<void *>(target));
+  if (extern_slots_) {
+    // Opcode: FF /2 m64 with rip-relative operand.
+    emit(0xFF);
+    emit(0x15);
+    AddExternSlot(symbol, address);
+    emitl(0);
+    return;
+  }
+  // 1110 1000 #32-bit disp.
+  emit(0xE8);
+  AddExternCall(symbol, address);
+  intptr_t displacement = address - (origin_ + pc_offset() + 4);
+  emitl(is_int32(displacement) ? displacement : 0);
+}
+
+void Assembler::patchable_call(const void *target, const char *symbol,
+                               Label *site) {
+  Align(4, 1);
+  EnsureSpace ensure_space(this);
+  Address address = static_cast<Address>(const_cast<void *>(target));
+  emit(0xE8);
+  bind(site);
+  AddExternCall(symbol, address);
+  intptr_t displacement = address - (origin_ + pc_offset() + 4);
+  emitl(is_int32(displacement) ? displacement : 0);
+}
+
+void Assembler::patchable_movl(Register dst, int32_t value, Label *site) {
+  Align(4, dst.high_bit() ? 2 : 1);
+  EnsureSpace ensure_space(this);
+  emit_optional_rex_32(dst);
+  emit(0xB8 | dst.low_bits());
+  bind(site);
+  emitl(value);
+}
+
+void Assembler::patchable_movq(Register dst, int64_t value, Label *site) {
+  Align(8, 2);
+  EnsureSpace ensure_space(this);
+  emit_rex_64(dst);
+  emit(0xB8 | dst.low_bits());
+  bind(site);
+  emitq(value);
+}
+
 void Assembler::clc() {
   EnsureSpace ensure_space(this);
   emit(0xF8);
@@ -772,6 +896,12 @@ void Assembler::enter(Immediate size) {
   emit(0xC8);
   emitw(size.value_);  // 16 bit operand, always.
   emit(0);
+  if (unwind_info()) {
+    frame_.stack += 8;
+    FrameSave(rbp);
+    FrameMove(rbp, rsp);
+    frame_.stack += size.value_;
+  }
 }
 
 void Assembler::hlt() {
@@ -908,9 +1038,12 @@ void Assembler::j(Condition cc, Label *l, Label::Distance distance) {
   }
   EnsureSpace ensure_space(this);
   // DCHECK(is_uint4(cc));
+  if (relax_) {
+    // Relaxation selects the jump size when the code is finalized.
+    distance = Label::kFar;
+  }
   if (l->is_bound()) {
     const int short_size = 2;
-    const int long_size  = 6;
     int offs = l->pos() - pc_offset();
     // DCHECK(offs <= 0);
     // Determine whether we can use 1-byte offsets for backwards branches,
@@ -918,78 +1051,52 @@ void Assembler::j(Condition cc, Label *l, Label::Distance distance) {
     if (is_int8(offs - short_size)) {
       // 0111 tttn #8-bit disp.
       emit(0x70 | cc);
-      emit((offs - short_size) & 0xFF);
+      emit(AddFixup(l, kJump8));
     } else {
       // 0000 1111 1000 tttn #32-bit disp.
       emit(0x0F);
       emit(0x80 | cc);
-      emitl(offs - long_size);
+      emitl(AddFixup(l, kJump32));
     }
   } else if (distance == Label::kNear) {
     // 0111 tttn #8-bit disp
     emit(0x70 | cc);
-    byte disp = 0x00;
-    if (l->is_near_linked()) {
-      int offset = l->near_link_pos() - pc_offset();
-      // DCHECK(is_int8(offset));
-      disp = static_cast<byte>(offset & 0xFF);
-    }
-    l->link_to(pc_offset(), Label::kNear);
-    emit(disp);
-  } else if (l->is_linked()) {
-    // 0000 1111 1000 tttn #32-bit disp.
-    emit(0x0F);
-    emit(0x80 | cc);
-    emitl(l->pos());
-    l->link_to(pc_offset() - sizeof(int32_t));
+    emit(AddFixup(l, kJump8));
   } else {
-    // DCHECK(l->is_unused());
+    // 0000 1111 1000 tttn #32-bit disp.
     emit(0x0F);
     emit(0x80 | cc);
-    int32_t current = pc_offset();
-    emitl(current);
-    l->link_to(current);
+    emitl(AddFixup(l, kJump32));
   }
 }
 
 void Assembler::jmp(Label *l, Label::Distance distance) {
   EnsureSpace ensure_space(this);
-  const int short_size = sizeof(int8_t);
-  const int long_size = sizeof(int32_t);
+  if (relax_) {
+    // Relaxation selects the jump size when the code is finalized.
+    distance = Label::kFar;
+  }
   if (l->is_bound()) {
-    int offs = l->pos() - pc_offset() - 1;
+    const int short_size = 2;
+    int offs = l->pos() - pc_offset();
     // DCHECK(offs <= 0);
     if (is_int8(offs - short_size)) {
       // 1110 1011 #8-bit disp.
       emit(0xEB);
-      emit((offs - short_size) & 0xFF);
+      emit(AddFixup(l, kJump8));
     } else {
       // 1110 1001 #32-bit disp.
       emit(0xE9);
-      emitl(offs - long_size);
+      emitl(AddFixup(l, kJump32));
     }
   } else if (distance == Label::kNear) {
+    // 1110 1011 #8-bit disp.
     emit(0xEB);
-    byte disp = 0x00;
-    if (l->is_near_linked()) {
-      int offset = l->near_link_pos() - pc_offset();
-      // DCHECK(is_int8(offset));
-      disp = static_cast<byte>(offset & 0xFF);
-    }
-    l->link_to(pc_offset(), Label::kNear);
-    emit(disp);
-  } else if (l->is_linked()) {
-    // 1110 1001 #32-bit disp.
-    emit(0xE9);
-    emitl(l->pos());
-    l->link_to(pc_offset() - long_size);
+    emit(AddFixup(l, kJump8));
   } else {
     // 1110 1001 #32-bit disp.
-    // DCHECK(l->is_unused());
     emit(0xE9);
-    int32_t current = pc_offset();
-    emitl(current);
-    l->link_to(current);
+    emitl(AddFixup(l, kJump32));
   }
 }
 
@@ -1016,8 +1123,18 @@ void Assembler::emit_lea(Register dst, const Operand &src, int size) {
   emit_operand(dst, src);
 }
 
-void Assembler::load_extern(Register dst, const void *value, const std::string &symbol) {
+void Assembler::load_extern(Register dst, const void *value,
+                            const char *symbol) {
   EnsureSpace ensure_space(this);
+  if (extern_slots_) {
+    // Opcode: REX.W 8B /r with rip-relative operand.
+    emit(0x48 | dst.high_bit() << 2);
+    emit(0x8B);
+    emit(0x05 | dst.low_bits() << 3);
+    AddExternSlot(symbol, static_cast<Address>(const_cast<void *>(value)));
+    emitl(0);
+    return;
+  }
   emit_rex(dst, kPointerSize);
   emit(0xB8 | dst.low_bits());
   AddExtern(symbol, static_cast<Address>(const_cast<void *>(value)));
@@ -1044,6 +1161,12 @@ void Assembler::load_rax(const void *value) {
 void Assembler::leave() {
   EnsureSpace ensure_space(this);
   emit(0xC9);
+  if (unwind_info() && frame_.rbp) {
+    frame_.rbp = false;
+    frame_.stack = frame_.frame - 8;
+    AddFrameOp(kDefineCfa, kDwarfRegisters[rsp.code()], frame_.stack);
+    FrameRestore(rbp);
+  }
 }
 
 void Assembler::movb(Register dst, const Operand &src) {
@@ -1141,6 +1264,7 @@ void Assembler::emit_mov(Register dst, Register src, int size) {
     emit(0x8B);
     emit_modrm(dst, src);
   }
+  if (size == kInt64Size) FrameMove(dst, src);
 }
 
 void Assembler::emit_mov(const Operand &dst, Register src, int size) {
@@ -1196,19 +1320,7 @@ void Assembler::movl(const Operand &dst, Label *src) {
   emit_optional_rex_32(dst);
   emit(0xC7);
   emit_operand(0, dst, 4);
-  if (src->is_bound()) {
-    int offset = src->pos() - pc_offset() - sizeof(int32_t);
-    // DCHECK(offset <= 0);
-    emitl(offset);
-  } else if (src->is_linked()) {
-    emitl(src->pos());
-    src->link_to(pc_offset() - sizeof(int32_t));
-  } else {
-    // DCHECK(src->is_unused());
-    int32_t current = pc_offset();
-    emitl(current);
-    src->link_to(current);
-  }
+  emitl(AddFixup(src, kRel32));
 }
 
 void Assembler::movsxbl(Register dst, Register src) {
@@ -1519,6 +1631,8 @@ void Assembler::popq(Register dst) {
   EnsureSpace ensure_space(this);
   emit_optional_rex_32(dst);
   emit(0x58 | dst.low_bits());
+  FrameAdjust(-8);
+  FrameRestore(dst);
 }
 
 void Assembler::popq(const Operand &dst) {
@@ -1526,17 +1640,21 @@ void Assembler::popq(const Operand &dst) {
   emit_optional_rex_32(dst);
   emit(0x8F);
   emit_operand(0, dst);
+  FrameAdjust(-8);
 }
 
 void Assembler::popfq() {
   EnsureSpace ensure_space(this);
   emit(0x9D);
+  FrameAdjust(-8);
 }
 
 void Assembler::pushq(Register src) {
   EnsureSpace ensure_space(this);
   emit_optional_rex_32(src);
   emit(0x50 | src.low_bits());
+  FrameAdjust(8);
+  FrameSave(src);
 }
 
 void Assembler::pushq(const Operand &src) {
@@ -1544,6 +1662,7 @@ void Assembler::pushq(const Operand &src) {
   emit_optional_rex_32(src);
   emit(0xFF);
   emit_operand(6, src);
+  FrameAdjust(8);
 }
 
 void Assembler::pushq(Immediate value) {
@@ -1555,17 +1674,20 @@ void Assembler::pushq(Immediate value) {
     emit(0x68);
     emitl(value.value_);
   }
+  FrameAdjust(8);
 }
 
 void Assembler::pushq_imm32(int32_t imm32) {
   EnsureSpace ensure_space(this);
   emit(0x68);
   emitl(imm32);
+  FrameAdjust(8);
 }
 
 void Assembler::pushfq() {
   EnsureSpace ensure_space(this);
   emit(0x9C);
+  FrameAdjust(8);
 }
 
 void Assembler::ret(int imm16) {
@@ -1661,6 +1783,14 @@ void Assembler::emit_xchg(Register dst, Register src, int size) {
   }
 }
 
+void Assembler::emit_xadd(const Operand &dst, Register src, int size) {
+  EnsureSpace ensure_space(this);
+  emit_rex(src, dst, size);
+  emit(0x0F);
+  emit(0xC1);
+  emit_operand(src, dst);
+}
+
 void Assembler::emit_xchg(Register dst, const Operand &src, int size) {
   EnsureSpace ensure_space(this);
   emit_rex(dst, src, size);
@@ -4780,23 +4910,15 @@ void Assembler::dq(uint64_t data) {
   emitq(data);
 }
 
+void Assembler::dd(Label *label, Label *base) {
+  // DCHECK(base->is_bound());
+  EnsureSpace ensure_space(this);
+  emitl(AddFixup(label, kOffset32, base->pos()));
+}
+
 void Assembler::dq(Label *label) {
   EnsureSpace ensure_space(this);
-  if (label->is_bound()) {
-    refs_.push_back(pc_offset());
-    emitp(buffer_ + label->pos());
-  } else {
-    emitl(0);  // zero for the first 32bit marks it as 64bit absolute address
-    if (label->is_linked()) {
-      emitl(label->pos());
-      label->link_to(pc_offset() - sizeof(int32_t));
-    } else {
-      // DCHECK(label->is_unused());
-      int32_t current = pc_offset();
-      emitl(current);
-      label->link_to(current);
-    }
-  }
+  emitq(AddFixup(label, kAbs64));
 }
 
 }  // namespace jit
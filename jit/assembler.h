@@ -87,12 +87,17 @@ class Operand {
 
   // Offset from existing memory operand.
   // Offset is added to existing displacement as 32-bit signed values and
-  // this must not overflow.
+  // this must not overflow. For rip-relative operands, the offset is added to
+  // the label or address instead.
   Operand(const Operand &base, int32_t offset);
 
   // [rip + disp/r]
   explicit Operand(Label *label);
 
+  // [rip + disp/r] for an address outside the code buffer. The address must
+  // be within rel32 reach of the final location of the code.
+  explicit Operand(const void *address);
+
   // Whether the generated instruction will have a REX prefix.
   bool requires_rex() const { return rex_ != 0; }
 
@@ -104,6 +109,8 @@ class Operand {
   byte rex_;     // register extension
   byte buf_[9];  // operand encoding
   byte len_;     // operand encoding size
+  bool absolute_ = false;  // rip-relative operand for absolute address
+  int32_t addend_ = 0;     // offset from rip-relative label or address
 
   // Set the ModR/M byte without an encoded 'reg' register. The
   // register is encoded later as part of the emit_operand operation.
@@ -158,22 +165,33 @@ class Operand {
 class Assembler : public CodeGenerator {
  public:
   // Create an assembler. Instructions are emitted into a buffer, with the
-  // instructions starting from the beginning.
-  Assembler(void *buffer, int buffer_size);
+  // instructions starting from the beginning. Code is generated for the CPU
+  // features in the feature set, which defaults to the features supported by
+  // the processor.
+  Assembler(void *buffer, int buffer_size,
+            CpuFeatures features = CpuFeatures::Supported());
+
+  // Create an assembler that emits instructions in place into a code heap.
+  explicit Assembler(CodeHeap *heap,
+                     CpuFeatures features = CpuFeatures::Supported());
+
+  // Reset assembler for generating new code. This also restores the CPU
+  // features to the features the assembler was created with.
+  void Reset();
 
   // Check if CPU feature is enabled by assembler.
-  bool Enabled(CpuFeature f) {
-    return (cpu_features_ & (1u << f)) != 0;
-  }
+  bool Enabled(CpuFeature f) const { return cpu_features_.Has(f); }
 
-  // Enable CPU feature.
-  void Enable(CpuFeature f) {
-    cpu_features_ |= (1u << f);
-  }
+  // Enable CPU feature. This only affects this assembler.
+  void Enable(CpuFeature f) { cpu_features_.Enable(f); }
+
+  // Disable CPU feature. This only affects this assembler.
+  void Disable(CpuFeature f) { cpu_features_.Disable(f); }
 
-  // Disable CPU feature.
-  void Disable(CpuFeature f) {
-    cpu_features_ &= ~(1u << f);
+  // CPU features enabled by assembler.
+  const CpuFeatures &cpu_features() const { return cpu_features_; }
+  void set_cpu_features(const CpuFeatures &features) {
+    cpu_features_ = features;
   }
 
   // One byte prefix for a short conditional jump.
@@ -252,8 +270,10 @@ class Assembler : public CodeGenerator {
 
   // Insert the smallest number of nop instructions
   // possible to align the pc offset to a multiple
-  // of m, where m must be a power of 2.
-  void Align(int m);
+  // of m, where m must be a power of 2. If an offset
+  // is given, the position offset bytes after the
+  // padding is aligned instead.
+  void Align(int m, int offset = 0);
 
   // Insert the smallest number of zero bytes possible to align the pc offset
   // to a mulitple of m. m must be a power of 2 (>= 2).
@@ -280,6 +300,15 @@ class Assembler : public CodeGenerator {
   void enter(Immediate size);
   void leave();
 
+  // Save and restore the call frame state for unwind information. With unwind
+  // information enabled, the assembler tracks the stack frame through pushq,
+  // popq, enter, leave, addq/subq of rsp, and movq between rsp and rbp. Code
+  // following a return in the middle of a function has the frame state from
+  // before the epilogue, so the state must be saved before the epilogue and
+  // restored after the return.
+  void RememberFrameState();
+  void RestoreFrameState();
+
   // Moves
   void movb(Register dst, const Operand &src);
   void movb(Register dst, Immediate imm);
@@ -329,8 +358,12 @@ class Assembler : public CodeGenerator {
   void repstosl() { emit_repstos(kInt32Size); }
   void repstosq() { emit_repstos(kInt64Size); }
 
-  // Loads an external reference into a register.
-  void load_extern(Register dst, const void *ptr, const std::string &symbol);
+  // Loads an external reference into a register. With extern slots, the
+  // address is loaded from the slot for the symbol.
+  void load_extern(Register dst, const void *ptr, const char *symbol);
+  void load_extern(Register dst, const void *ptr, const std::string &symbol) {
+    load_extern(dst, ptr, symbol.c_str());
+  }
 
   // Instruction to load from an immediate 64-bit pointer into RAX.
   void load_rax(const void *ptr);
@@ -586,19 +619,43 @@ class Assembler : public CodeGenerator {
   // Call near relative 32-bit displacement, relative to next instruction.
   void call(Label *l);
 
-  // Calls directly to the given address using a relative offset.
-  // Should only ever be used in Code objects for calls within the
-  // same Code object. Should not be used when generating new code (use labels),
-  // but only when patching existing code.
+  // Calls directly to the given address using a relative offset. The offset
+  // is computed relative to the origin of the code buffer and is adjusted
+  // when the code is moved. The target must be within +/-2GB of the code.
   void call(Address target);
 
   // Call near absolute indirect, address in register
   void call(Register adr);
 
+  // Calls external function. This emits a direct rel32 call if the function
+  // can be reached from the final code address; otherwise the call goes
+  // through an out-of-line veneer added when the code is finalized. With
+  // extern slots, the function is called indirectly through the slot for the
+  // symbol.
+  void call_extern(const void *target, const char *symbol);
+  void call_extern(const void *target, const std::string &symbol) {
+    call_extern(target, symbol.c_str());
+  }
+
+  // Patchable instructions. The patchable field of the instruction is
+  // aligned, so it never straddles a cache line and can be updated with a
+  // single atomic store while the code is running. The site label is bound
+  // to the patchable field, and the field can be updated with Code::Patch()
+  // at the offset Translate(site->pos()) in the finalized code.
+
+  // Call external function with patchable rel32 displacement. The call is
+  // always direct, so new targets must be within rel32 reach of the code.
+  void patchable_call(const void *target, const char *symbol, Label *site);
+
+  // Load patchable 32-bit or 64-bit immediate into register.
+  void patchable_movl(Register dst, int32_t value, Label *site);
+  void patchable_movq(Register dst, int64_t value, Label *site);
+
   // Jumps
   // Jump short or near relative.
   // Use a 32-bit signed displacement.
-  // Unconditional jump to L
+  // Unconditional jump to L. With branch relaxation, the distance is ignored
+  // and the shortest encoding is selected when the code is finalized.
   void jmp(Label *l, Label::Distance distance = Label::kFar);
 
   // Jump near absolute indirect (r64)
@@ -2602,6 +2659,9 @@ class Assembler : public CodeGenerator {
   void dp(uintptr_t data) { dq(data); }
   void dq(Label *label);
 
+  // Emit 32-bit offset of label relative to a bound base label.
+  void dd(Label *label, Label *base);
+
   // Call near indirect
   void call(const Operand &operand);
 
@@ -2950,6 +3010,7 @@ class Assembler : public CodeGenerator {
 
   void emit_add(Register dst, Immediate src, int size) {
     immediate_arithmetic_op(0x0, dst, src, size);
+    if (dst.is(rsp) && size == kInt64Size) FrameAdjust(-src.value_);
   }
 
   void emit_add(Register dst, const Operand &src, int size) {
@@ -3083,6 +3144,7 @@ class Assembler : public CodeGenerator {
 
   void emit_sub(Register dst, Immediate src, int size) {
     immediate_arithmetic_op(0x5, dst, src, size);
+    if (dst.is(rsp) && size == kInt64Size) FrameAdjust(src.value_);
   }
 
   void emit_sub(Register dst, const Operand &src, int size) {
@@ -3105,6 +3167,10 @@ class Assembler : public CodeGenerator {
     return emit_test(op, reg, size);
   }
 
+  // Exchange src and dst and store the sum in dst. This operation is only
+  // atomic if prefixed by the lock instruction.
+  void emit_xadd(const Operand &dst, Register src, int size);
+
   void emit_xchg(Register dst, Register src, int size);
   void emit_xchg(Register dst, const Operand &src, int size);
 
@@ -3143,7 +3209,28 @@ class Assembler : public CodeGenerator {
              const Operand &rm);
 
   // Enabled CPU features.
-  unsigned cpu_features_;
+  CpuFeatures cpu_features_;
+
+  // CPU features restored when the assembler is reset.
+  CpuFeatures default_features_;
+
+  // Record call frame changes for unwind information when the stack grows by
+  // delta bytes, when a register is saved on top of the stack or restored
+  // from it, and when a register is moved to another.
+  void FrameAdjust(int delta);
+  void FrameSave(Register reg);
+  void FrameRestore(Register reg);
+  void FrameMove(Register dst, Register src);
+
+  // Call frame state. The CFA is relative to rsp until the frame pointer has
+  // been set up, after which it is relative to rbp.
+  struct FrameState {
+    bool rbp;   // CFA is relative to rbp
+    int stack;  // offset of rsp below CFA
+    int frame;  // offset of rbp below CFA
+  };
+  FrameState frame_ = {false, 8, 0};
+  std::vector<FrameState> frame_states_;
 };
 
 }  // namespace jit
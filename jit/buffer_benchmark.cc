@@ -0,0 +1,54 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Benchmark for compile time of large functions with flat and segmented code
+// buffers. The time covers code generation, finalization, and installing the
+// code in executable memory.
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+
+#include "jit/assembler.h"
+
+using namespace sling::jit;
+
+// Generate function with the given code size and return the compile time in
+// milliseconds. Every 64 bytes of code has an absolute reference to a label,
+// which must be relocated when the code buffer is moved.
+static double Compile(int size, bool segmented) {
+  auto start = std::chrono::steady_clock::now();
+  Assembler masm(nullptr, 0);
+  masm.set_segmented(segmented);
+  Label entry;
+  masm.bind(&entry);
+  Label body;
+  masm.jmp(&body);
+  while (masm.pc_offset() < size) {
+    masm.dq(&entry);
+    for (int i = 0; i < 8; ++i) masm.movq(rax, Operand(rbx, i * 8));
+  }
+  masm.bind(&body);
+  masm.ret(0);
+  Code code(&masm);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main() {
+  static const int kSizes[] = {1 << 10, 1 << 20, 64 << 20};
+  printf("%10s %12s %12s\n", "size", "flat ms", "segmented ms");
+  for (int size : kSizes) {
+    // Use the best of several runs.
+    int runs = size < (1 << 20) ? 1000 : size < (64 << 20) ? 20 : 3;
+    double flat = 1e300;
+    double segmented = 1e300;
+    for (int i = 0; i < runs; ++i) {
+      flat = std::min(flat, Compile(size, false));
+      segmented = std::min(segmented, Compile(size, true));
+    }
+    printf("%10d %12.3f %12.3f\n", size, flat, segmented);
+  }
+  return 0;
+}
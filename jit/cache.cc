@@ -0,0 +1,280 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jit/cache.h"
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace sling {
+namespace jit {
+
+// Cache file format. The file starts with a header followed by the key, the
+// name, and the code. The code is followed by the positions of the internal
+// references and a record for each external symbol with the positions of the
+// references and calls to the symbol followed by the symbol name.
+namespace {
+
+const uint32_t kCacheMagic = 0x4354494A;  // "JITC"
+
+struct CacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t features;
+  uint32_t key_size;
+  uint32_t name_size;
+  uint32_t code_size;
+  uint32_t num_refs;
+  uint32_t num_externs;
+};
+
+struct CacheExtern {
+  uint32_t symbol_size;
+  uint32_t num_refs;
+  uint32_t num_calls;
+  int32_t slot;
+  int32_t veneer;
+};
+
+// Append data to cache file.
+void Put(std::string *file, const void *data, size_t size) {
+  file->append(static_cast<const char *>(data), size);
+}
+
+void Put(std::string *file, const std::vector<int> &positions) {
+  Put(file, positions.data(), positions.size() * sizeof(int32_t));
+}
+
+// Reader for cache file that checks that all reads are within the file.
+class Reader {
+ public:
+  Reader(const char *data, size_t size) : ptr_(data), end_(data + size) {}
+
+  // Return pointer to the next size bytes, or null if the file is too short.
+  const char *Get(size_t size) {
+    if (static_cast<size_t>(end_ - ptr_) < size) return nullptr;
+    const char *data = ptr_;
+    ptr_ += size;
+    return data;
+  }
+
+  bool Get(void *data, size_t size) {
+    const char *p = Get(size);
+    if (p == nullptr) return false;
+    memcpy(data, p, size);
+    return true;
+  }
+
+  // Read positions of fields with the given size in the code.
+  bool Get(std::vector<int> *positions, uint32_t count, int field,
+           uint32_t code_size) {
+    if (count > (end_ - ptr_) / sizeof(int32_t)) return false;
+    positions->resize(count);
+    if (!Get(positions->data(), count * sizeof(int32_t))) return false;
+    for (int pos : *positions) {
+      if (pos < 0 || static_cast<uint32_t>(pos) + field > code_size) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  const char *ptr_;
+  const char *end_;
+};
+
+// Hash for file names (64-bit FNV-1a).
+uint64_t Hash(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *p = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= p[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+}  // namespace
+
+CodeCache::CodeCache(const std::string &directory, CpuFeatures features)
+    : directory_(directory), features_(features) {
+  resolver_ = [](const char *symbol) -> const void * {
+    return dlsym(RTLD_DEFAULT, symbol);
+  };
+}
+
+std::string CodeCache::FileName(const std::string &key) const {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  uint32_t features = features_.mask();
+  uint32_t version = kVersion;
+  hash = Hash(hash, key.data(), key.size());
+  hash = Hash(hash, &features, sizeof(features));
+  hash = Hash(hash, &version, sizeof(version));
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.jit",
+           static_cast<unsigned long long>(hash));
+  return directory_ + name;
+}
+
+bool CodeCache::Store(const std::string &key, CodeGenerator *generator) const {
+  generator->Finalize();
+  if (!generator->pcrel().empty()) return false;
+
+  // Copy code with the internal references relative to the start of the
+  // code. The references to external symbols are cleared, since these are
+  // filled in when the code is loaded.
+  int size = generator->size();
+  std::string code(size, 0);
+  byte *data = reinterpret_cast<byte *>(&code[0]);
+  generator->CopyTo(data, nullptr);
+  for (const Extern &e : generator->externs()) {
+    for (int pos : e.refs) memset(data + pos, 0, sizeof(int64_t));
+    for (int pos : e.calls) memset(data + pos, 0, sizeof(int32_t));
+  }
+
+  // Build cache file.
+  CacheHeader header;
+  header.magic = kCacheMagic;
+  header.version = kVersion;
+  header.features = features_.mask();
+  header.key_size = key.size();
+  header.name_size = generator->name().size();
+  header.code_size = size;
+  header.num_refs = generator->refs().size();
+  header.num_externs = generator->externs().size();
+  std::string file;
+  Put(&file, &header, sizeof(header));
+  Put(&file, key.data(), key.size());
+  Put(&file, generator->name().data(), generator->name().size());
+  Put(&file, code.data(), code.size());
+  Put(&file, generator->refs());
+  for (const Extern &e : generator->externs()) {
+    CacheExtern ext;
+    ext.symbol_size = strlen(e.symbol);
+    ext.num_refs = e.refs.size();
+    ext.num_calls = e.calls.size();
+    ext.slot = e.slot;
+    ext.veneer = e.veneer;
+    Put(&file, &ext, sizeof(ext));
+    Put(&file, e.refs);
+    Put(&file, e.calls);
+    Put(&file, e.symbol, ext.symbol_size);
+  }
+
+  // Write the file to a temporary file and rename it, so readers either see
+  // the complete file or no file.
+  std::string filename = FileName(key);
+  std::string tmpname = filename + ".XXXXXX";
+  int fd = mkstemp(&tmpname[0]);
+  if (fd < 0) return false;
+  bool ok = true;
+  const char *p = file.data();
+  size_t left = file.size();
+  while (ok && left > 0) {
+    ssize_t n = write(fd, p, left);
+    if (n <= 0) {
+      ok = false;
+    } else {
+      p += n;
+      left -= n;
+    }
+  }
+  if (fchmod(fd, 0644) != 0) ok = false;
+  if (close(fd) != 0) ok = false;
+  if (ok && rename(tmpname.c_str(), filename.c_str()) != 0) ok = false;
+  if (!ok) unlink(tmpname.c_str());
+  return ok;
+}
+
+Code *CodeCache::Lookup(const std::string &key, CodeHeap *heap) const {
+  // Map cache file.
+  int fd = open(FileName(key).c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return nullptr;
+
+  // Read and check header. The key is compared, since different keys can
+  // have the same file name.
+  Reader reader(static_cast<const char *>(mapping), st.st_size);
+  CacheHeader header;
+  if (!reader.Get(&header, sizeof(header))) {
+    munmap(mapping, st.st_size);
+    return nullptr;
+  }
+  const char *k = nullptr;
+  const char *name = nullptr;
+  const char *code = nullptr;
+  std::vector<int> refs;
+  bool ok = header.magic == kCacheMagic &&
+            header.version == kVersion &&
+            header.features == features_.mask() &&
+            header.key_size == key.size() &&
+            (k = reader.Get(header.key_size)) != nullptr &&
+            memcmp(k, key.data(), key.size()) == 0 &&
+            (name = reader.Get(header.name_size)) != nullptr &&
+            (code = reader.Get(header.code_size)) != nullptr &&
+            reader.Get(&refs, header.num_refs, sizeof(int64_t),
+                       header.code_size);
+
+  // Read external symbols and resolve them by name. The symbol names are
+  // kept until the code has been loaded.
+  if (header.num_externs > st.st_size / sizeof(CacheExtern)) ok = false;
+  std::vector<std::string> symbols(ok ? header.num_externs : 0);
+  std::vector<Extern> externs;
+  for (size_t i = 0; ok && i < symbols.size(); ++i) {
+    CacheExtern ext;
+    std::vector<int> ext_refs;
+    std::vector<int> calls;
+    const char *symbol = nullptr;
+    ok = reader.Get(&ext, sizeof(ext)) &&
+         reader.Get(&ext_refs, ext.num_refs, sizeof(Address),
+                    header.code_size) &&
+         reader.Get(&calls, ext.num_calls, sizeof(int32_t),
+                    header.code_size) &&
+         (symbol = reader.Get(ext.symbol_size)) != nullptr &&
+         ext.slot >= -1 && ext.slot < static_cast<int>(header.code_size) &&
+         ext.veneer >= -1 && ext.veneer < static_cast<int>(header.code_size);
+    if (!ok) break;
+    symbols[i].assign(symbol, ext.symbol_size);
+    const void *address = resolver_(symbols[i].c_str());
+    if (address == nullptr) {
+      ok = false;
+      break;
+    }
+    externs.emplace_back(symbols[i].c_str(),
+                         static_cast<Address>(const_cast<void *>(address)));
+    Extern &e = externs.back();
+    e.refs = std::move(ext_refs);
+    e.calls = std::move(calls);
+    e.slot = ext.slot;
+    e.veneer = ext.veneer;
+  }
+
+  // Install code.
+  Code *result = nullptr;
+  if (ok) {
+    CodeGenerator generator(nullptr, 0);
+    generator.Load(code, header.code_size, refs, externs);
+    generator.set_name(std::string(name, header.name_size));
+    result = new Code(heap, &generator);
+  }
+  munmap(mapping, st.st_size);
+  return result;
+}
+
+}  // namespace jit
+}  // namespace sling
@@ -0,0 +1,80 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_CACHE_H_
+#define JIT_CACHE_H_
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+
+#include "jit/code.h"
+#include "jit/cpu.h"
+#include "jit/heap.h"
+
+namespace sling {
+namespace jit {
+
+// Persistent cache for finalized code, so processes can reuse code generated
+// by earlier processes instead of generating it again. Each entry is stored
+// in a separate file in the cache directory, which holds the code and the
+// positions of the references in the code that need to be relocated. Entries
+// are looked up by a key supplied by the caller, e.g. a hash of the
+// specification of the generated code, combined with the CPU features the
+// code is generated for and the cache format version.
+//
+// When code is loaded from the cache, the external symbols are resolved by
+// name, so the code does not depend on the address layout of the process
+// that generated it. Entries are written to a temporary file which is then
+// renamed, so concurrent processes never see partially written entries.
+class CodeCache {
+ public:
+  // Version of cache file format and code generator. This must be changed
+  // when the generated code changes, so stale entries are not used.
+  static const uint32_t kVersion = 1;
+
+  // Resolver for looking up the address of an external symbol by name.
+  // Returns null if the symbol cannot be resolved.
+  typedef std::function<const void *(const char *symbol)> Resolver;
+
+  // Initialize code cache in a directory for code generated for a set of CPU
+  // features. The directory must exist. External symbols are resolved with
+  // the dynamic linker by default.
+  explicit CodeCache(const std::string &directory,
+                     CpuFeatures features = CpuFeatures::Supported());
+
+  // Set resolver for external symbols.
+  void set_resolver(Resolver resolver) { resolver_ = std::move(resolver); }
+
+  // Look up code in the cache and install it, optionally in a code heap.
+  // Returns null if the code is not in the cache, or if it cannot be loaded,
+  // e.g. because an external symbol cannot be resolved. The caller takes
+  // ownership of the returned code.
+  Code *Lookup(const std::string &key, CodeHeap *heap = nullptr) const;
+
+  // Finalize code generator and store its code in the cache. This must be
+  // done before the code is installed, since code generated in place is
+  // handed over to the code object. Returns false if the code cannot be
+  // cached, i.e. if it has pc-relative references to addresses outside the
+  // code that are not external symbols, or if the entry cannot be written.
+  bool Store(const std::string &key, CodeGenerator *generator) const;
+
+  // File name for cache entry.
+  std::string FileName(const std::string &key) const;
+
+ private:
+  // Cache directory.
+  std::string directory_;
+
+  // CPU features for code in cache.
+  CpuFeatures features_;
+
+  // Resolver for external symbols.
+  Resolver resolver_;
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_CACHE_H_
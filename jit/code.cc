@@ -33,18 +33,30 @@
 // Copyright 2012 the V8 project authors. All rights reserved.
 // Copyright 2017 Google Inc. All rights reserved.
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <linux/membarrier.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
 
 #include "jit/code.h"
 #include "jit/types.h"
 
+// Unwinder functions for registering .eh_frame sections.
+extern "C" void __register_frame(void *begin);
+extern "C" void __deregister_frame(void *begin);
+
 namespace sling {
 namespace jit {
 
 int Label::pos() const {
   if (pos_ < 0) return -pos_ - 1;
-  if (pos_ > 0) return  pos_ - 1;
   // LOG(FATAL) << "Unresolved label";
   return 0;
 }
@@ -58,31 +70,192 @@ CodeGenerator::CodeGenerator(void *buffer, int buffer_size) {
   buffer_size_ = buffer_size;
 
   pc_ = buffer_;
+  origin_ = buffer_;
+  heap_ = nullptr;
+  UpdateLimit();
+}
+
+CodeGenerator::CodeGenerator(CodeHeap *heap) {
+  own_buffer_ = false;
+  heap_ = heap;
+  origin_ = heap->Allocate(kMinimalBufferSize);
+  // CHECK(origin_ != nullptr);
+  buffer_ = heap->Writable(origin_);
+  buffer_size_ = kMinimalBufferSize;
+
+  pc_ = buffer_;
+  UpdateLimit();
 }
 
-void CodeGenerator::GrowBuffer() {
-  // DCHECK(buffer_overflow());
+void CodeGenerator::GrowBuffer(int space) {
+  // New buffer size must have room for the requested space.
+  int needed = space + kMaximumInstructionSize;
+  int size = buffer_size_ * 2;
+  if (heap_ != nullptr) {
+    // Move code to a larger block in the code heap.
+    while (size < pc_offset() + needed) size *= 2;
+    Address origin = heap_->Allocate(size);
+    // CHECK(origin != nullptr);
+    byte *buffer = heap_->Writable(origin);
+    CopyTo(buffer, origin);
+    heap_->Commit(origin_);
+    heap_->Free(origin_, buffer_size_);
+    pc_ = buffer + pc_offset();
+    buffer_ = buffer;
+    buffer_size_ = size;
+    origin_ = origin;
+    UpdateLimit();
+    return;
+  }
+
   if (!own_buffer_) { //  LOG(FATAL) << "external code buffer is too small";
   }
 
+  if (segmented_) {
+    // Continue code generation in a new chunk. The code already generated
+    // stays in place, so no references need to be relocated.
+    int used = pc_ - buffer_;
+    chunks_.push_back({buffer_, chunk_offset_, used});
+    chunk_offset_ += used;
+    if (size > kMaximumChunkSize) size = buffer_size_;
+    while (size < needed) size *= 2;
+    buffer_size_ = size;
+    buffer_ = static_cast<byte *>(malloc(buffer_size_));
+    pc_ = buffer_;
+    UpdateLimit();
+    return;
+  }
+
   // Expand code buffer.
-  byte *old_buffer = buffer_;
-  buffer_size_ *= 2;
+  while (size < pc_offset() + needed) size *= 2;
+  uintptr_t old_buffer = reinterpret_cast<uintptr_t>(buffer_);
+  buffer_size_ = size;
   buffer_ = static_cast<byte*>(realloc(buffer_, buffer_size_));
-  intptr_t pc_delta = buffer_ - old_buffer;
+  intptr_t pc_delta = reinterpret_cast<uintptr_t>(buffer_) - old_buffer;
   pc_ += pc_delta;
 
-  // Relocate internal references.
-  for (auto pos : refs_) {
-    intptr_t *p = reinterpret_cast<intptr_t *>(buffer_ + pos);
-    *p += pc_delta;
-  }
+  // Relocate internal and external references.
+  Relocate(buffer_, origin_ + pc_delta);
+  origin_ += pc_delta;
+  UpdateLimit();
 
   // DCHECK(!buffer_overflow());
 }
 
+void CodeGenerator::Reserve(int bytes) {
+  if (available_space() < bytes + kMaximumInstructionSize) GrowBuffer(bytes);
+}
+
+void CodeGenerator::UpdateLimit() {
+  if (reservations_ > 0) {
+    // Instructions are emitted unchecked while space is reserved.
+    limit_ = reinterpret_cast<byte *>(UINTPTR_MAX);
+  } else if (buffer_ == nullptr) {
+    limit_ = nullptr;
+  } else {
+    limit_ = buffer_ + buffer_size_ - kMaximumInstructionSize;
+  }
+}
+
+byte *CodeGenerator::ChunkAddress(int pos) {
+  // Find last chunk starting at or before position.
+  auto it = std::upper_bound(chunks_.begin(), chunks_.end(), pos,
+      [](int pos, const Chunk &chunk) { return pos < chunk.offset; });
+  const Chunk &chunk = *(it - 1);
+  return chunk.data + (pos - chunk.offset);
+}
+
+void CodeGenerator::Flatten(int capacity) {
+  // DCHECK(own_buffer_);
+  int size = pc_offset();
+  if (capacity < size + kMaximumInstructionSize) {
+    capacity = size + kMaximumInstructionSize;
+  }
+  if (chunks_.empty() && capacity <= buffer_size_) return;
+
+  // Copy the code into a new buffer and relocate it to the new buffer.
+  byte *buffer = static_cast<byte *>(malloc(capacity));
+  CopyTo(buffer, buffer);
+  for (Chunk &chunk : chunks_) free(chunk.data);
+  free(buffer_);
+  chunks_.clear();
+  chunk_offset_ = 0;
+  buffer_ = buffer;
+  buffer_size_ = capacity;
+  pc_ = buffer_ + size;
+  origin_ = buffer_;
+  UpdateLimit();
+}
+
 CodeGenerator::~CodeGenerator() {
-  if (own_buffer_) free(buffer_);
+  if (own_buffer_) {
+    for (Chunk &chunk : chunks_) free(chunk.data);
+    free(buffer_);
+  }
+  if (heap_ != nullptr && origin_ != nullptr) {
+    heap_->Commit(origin_);
+    heap_->Free(origin_, buffer_size_);
+  }
+}
+
+Address CodeGenerator::Commit() {
+  // DCHECK(in_place());
+  Address code = origin_;
+  heap_->Shrink(code, buffer_size_, pc_offset());
+  heap_->Commit(code);
+  origin_ = nullptr;
+  buffer_ = pc_ = nullptr;
+  buffer_size_ = 0;
+  UpdateLimit();
+  return code;
+}
+
+void CodeGenerator::Reset() {
+  // DCHECK(reservations_ == 0);
+  if (heap_ != nullptr) {
+    if (origin_ == nullptr) {
+      origin_ = heap_->Allocate(kMinimalBufferSize);
+      // CHECK(origin_ != nullptr);
+      buffer_ = heap_->Writable(origin_);
+      buffer_size_ = kMinimalBufferSize;
+    }
+  } else {
+    // Keep the current chunk, which is the largest one.
+    for (Chunk &chunk : chunks_) free(chunk.data);
+    chunks_.clear();
+    chunk_offset_ = 0;
+    origin_ = buffer_;
+  }
+  pc_ = buffer_;
+  UpdateLimit();
+
+  refs_.clear();
+  pcrel_.clear();
+  externs_.clear();
+  extern_index_.clear();
+  fixups_.clear();
+  aligns_.clear();
+  relax_keys_.clear();
+  relax_delta_.clear();
+  constant_data_.clear();
+  constants_.clear();
+  constant_labels_.clear();
+  std::fill(constant_index_.begin(), constant_index_.end(), 0);
+  shared_data_.clear();
+  shared_constants_.clear();
+  shared_index_.clear();
+  shared_refs_.clear();
+  ranges_.clear();
+  section_ = kHotSection;
+  name_.clear();
+  lines_.clear();
+  symbols_.clear();
+  frame_ops_.clear();
+  relax_ = false;
+  segmented_ = false;
+  extern_slots_ = false;
+  unwind_info_ = false;
+  finalized_ = false;
 }
 
 void CodeGenerator::bind(Label *l) {
@@ -92,93 +265,1084 @@ void CodeGenerator::bind(Label *l) {
 void CodeGenerator::bind_to(Label *l, int pos) {
   // DCHECK(!l->is_bound());  // label may only be bound once
   // DCHECK(0 <= pos && pos <= pc_offset());  // position must be valid
-  if (l->is_linked()) {
-    int current = l->pos();
-    int next = long_at(current);
-    int sl = 0;
-    if (next < 0) {
-      sl = 1;
-      next = -next;
-    }
-    while (next != current) {
-      if (current >= 4 && long_at(current - 4) == 0) {
-        // Absolute address.
-        intptr_t imm64 = reinterpret_cast<intptr_t>(buffer_ + pos);
-        *reinterpret_cast<intptr_t *>(addr_at(current - 4)) = imm64;
-        refs_.push_back(current - 4);
+  int index = l->pos_ - 1;
+  while (index >= 0) {
+    Fixup &fixup = fixups_[index];
+    fixup.target = pos;
+    Patch(fixup);
+    index = fixup.next;
+    fixup.next = -1;
+  }
+  l->bind_to(pos);
+}
+
+int64_t CodeGenerator::AddFixup(Label *label, FixupKind kind, int arg) {
+  Fixup fixup;
+  fixup.kind = kind;
+  fixup.pos = pc_offset();
+  fixup.arg = arg;
+  fixup.next = -1;
+  if (label->is_bound()) {
+    fixup.target = label->pos();
+    fixups_.push_back(fixup);
+    if (kind == kAbs64) refs_.push_back(fixup.pos);
+    return FixupValue(fixup);
+  }
+
+  // Add reference to the chain of unresolved references to the label.
+  fixup.target = -1;
+  fixup.next = label->pos_ - 1;
+  fixups_.push_back(fixup);
+  label->pos_ = fixups_.size();
+  return 0;
+}
+
+int64_t CodeGenerator::FixupValue(const Fixup &fixup) const {
+  switch (fixup.kind) {
+    case kJump8:
+      return fixup.target - (fixup.pos + sizeof(int8_t));
+    case kJump32:
+    case kRel32:
+      return fixup.target - (fixup.pos + sizeof(int32_t) + fixup.arg);
+    case kAbs64:
+      return reinterpret_cast<int64_t>(origin_ + fixup.target);
+    case kOffset32:
+      return fixup.target - fixup.arg;
+  }
+  return 0;
+}
+
+void CodeGenerator::Patch(const Fixup &fixup) {
+  int64_t value = FixupValue(fixup);
+  switch (fixup.kind) {
+    case kJump8:
+      // CHECK(is_int8(value));
+      set_byte_at(fixup.pos, value);
+      break;
+    case kJump32:
+    case kRel32:
+    case kOffset32:
+      long_at_put(fixup.pos, value);
+      break;
+    case kAbs64:
+      *reinterpret_cast<int64_t *>(addr_at(fixup.pos)) = value;
+      refs_.push_back(fixup.pos);
+      break;
+  }
+}
+
+const char *Extern::Intern(const char *name) {
+  static std::mutex mu;
+  static std::unordered_set<std::string> *symbols =
+      new std::unordered_set<std::string>();
+  std::lock_guard<std::mutex> lock(mu);
+  return symbols->insert(name).first->c_str();
+}
+
+int CodeGenerator::FindExtern(const char *symbol, Address address) {
+  // Try to find existing external reference.
+  auto f = extern_index_.find(address);
+  if (f != extern_index_.end()) return f->second;
+
+  // Add new external symbol.
+  int index = externs_.size();
+  externs_.emplace_back(Extern::Intern(symbol), address);
+  extern_index_[address] = index;
+  return index;
+}
+
+void CodeGenerator::AddExtern(const char *symbol, Address address) {
+  // Add reference to external symbol.
+  int index = FindExtern(symbol, address);
+  externs_[index].refs.push_back(pc_offset());
+}
+
+void CodeGenerator::AddExternCall(const char *symbol, Address address) {
+  // Add call to external symbol.
+  int index = FindExtern(symbol, address);
+  externs_[index].calls.push_back(pc_offset());
+}
+
+void CodeGenerator::AddExternSlot(const char *symbol, Address address) {
+  // Add reference to slot for external symbol.
+  int index = FindExtern(symbol, address);
+  externs_[index].slot_refs.push_back(pc_offset());
+}
+
+// Hash for constant data (64-bit FNV-1a).
+static uint64_t ConstantHash(const void *data, int size) {
+  const byte *p = static_cast<const byte *>(data);
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (int i = 0; i < size; ++i) {
+    hash ^= p[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+Label *CodeGenerator::AddConstant(const void *data, int size,
+                                  int alignment) {
+  // Grow the constant index so it is at most half full. The index is rebuilt
+  // from the constants.
+  int index = constants_.size();
+  if (2 * (index + 1) > static_cast<int>(constant_index_.size())) {
+    int table_size = constant_index_.empty() ? 16 : constant_index_.size() * 2;
+    constant_index_.assign(table_size, 0);
+    for (int i = 0; i < index; ++i) {
+      const Constant &c = constants_[i];
+      uint64_t hash = ConstantHash(constant_data_.data() + c.offset, c.size);
+      int slot = hash & (table_size - 1);
+      while (constant_index_[slot] != 0) slot = (slot + 1) & (table_size - 1);
+      constant_index_[slot] = i + 1;
+    }
+  }
+
+  // Try to find existing constant with the same content. The alignment is
+  // raised if the constant is needed with a larger alignment.
+  int mask = constant_index_.size() - 1;
+  int slot = ConstantHash(data, size) & mask;
+  while (constant_index_[slot] != 0) {
+    int existing = constant_index_[slot] - 1;
+    Constant &c = constants_[existing];
+    if (c.size == size &&
+        memcmp(constant_data_.data() + c.offset, data, size) == 0) {
+      if (alignment > c.alignment) c.alignment = alignment;
+      return &constant_labels_[existing];
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  // Add new constant.
+  constants_.push_back({static_cast<int>(constant_data_.size()), size,
+                        alignment});
+  constant_data_.append(static_cast<const char *>(data), size);
+  constant_labels_.emplace_back();
+  constant_index_[slot] = index + 1;
+  return &constant_labels_[index];
+}
+
+void CodeGenerator::AddSharedConstant(Address address, const void *data,
+                                      int size, int alignment) {
+  if (shared_index_.count(address) != 0) return;
+  shared_index_[address] = shared_constants_.size();
+  shared_constants_.push_back({address, static_cast<int>(shared_data_.size()),
+                               size, alignment});
+  shared_data_.append(static_cast<const char *>(data), size);
+}
+
+void CodeGenerator::AddSharedReference(Address target, int arg) {
+  // Find the shared constant containing the target address.
+  auto f = shared_index_.upper_bound(target);
+  if (f == shared_index_.begin()) return;
+  --f;
+  const SharedConstant &c = shared_constants_[f->second];
+  int offset = target - c.address;
+  if (offset >= c.size) return;
+  shared_refs_.push_back({pc_offset(), arg, f->second, offset});
+}
+
+bool CodeGenerator::SharedConstantsReachable(Address origin) const {
+  for (const SharedRef &r : shared_refs_) {
+    Address target = shared_constants_[r.constant].address + r.offset;
+    Address source = origin + r.pos + sizeof(int32_t) + r.arg;
+    if (!is_int32(target - source)) return false;
+  }
+  return true;
+}
+
+int CodeGenerator::LocalConstantsSize() const {
+  int size = pc_offset();
+  for (const SharedConstant &c : shared_constants_) {
+    size += (-size & (c.alignment - 1)) + c.size;
+  }
+  return size;
+}
+
+void CodeGenerator::CopyLocalConstants(byte *dst) const {
+  // Place the constants after the code in the order they were added.
+  std::vector<int> local(shared_constants_.size());
+  int pos = pc_offset();
+  for (size_t i = 0; i < shared_constants_.size(); ++i) {
+    const SharedConstant &c = shared_constants_[i];
+    int padding = -pos & (c.alignment - 1);
+    memset(dst + pos, 0, padding);
+    pos += padding;
+    memcpy(dst + pos, shared_data_.data() + c.offset, c.size);
+    local[i] = pos;
+    pos += c.size;
+  }
+
+  // Redirect the references to the copies.
+  for (const SharedRef &r : shared_refs_) {
+    int target = local[r.constant] + r.offset;
+    int32_t *disp = reinterpret_cast<int32_t *>(dst + r.pos);
+    *disp = target - (r.pos + sizeof(int32_t) + r.arg);
+  }
+}
+
+void CodeGenerator::FlushConstants() {
+  // Emit the constants with the largest alignment first to reduce padding.
+  // Constants with the same alignment are emitted in the order they were
+  // added.
+  int max_alignment = 1;
+  for (const Constant &c : constants_) {
+    max_alignment = std::max(max_alignment, c.alignment);
+  }
+  for (int alignment = max_alignment; alignment > 0; alignment /= 2) {
+    for (size_t i = 0; i < constants_.size(); ++i) {
+      const Constant &c = constants_[i];
+      if (c.alignment != alignment || constant_labels_[i].is_bound()) continue;
+      int padding = -pc_offset() & (c.alignment - 1);
+      Reserve(padding + c.size);
+      memset(pc_, 0, padding);
+      pc_ += padding;
+      bind(&constant_labels_[i]);
+      memcpy(pc_, constant_data_.data() + c.offset, c.size);
+      pc_ += c.size;
+    }
+  }
+}
+
+// Recommended multi-byte NOP sequences from the Intel 64 and IA-32
+// Architectures Software Developer's Manual.
+static const byte kNops[9][9] = {
+  {0x90},
+  {0x66, 0x90},
+  {0x0F, 0x1F, 0x00},
+  {0x0F, 0x1F, 0x40, 0x00},
+  {0x0F, 0x1F, 0x44, 0x00, 0x00},
+  {0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},
+  {0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},
+  {0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+  {0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+
+static void FillNops(byte *p, int n) {
+  while (n > 0) {
+    int len = n > 9 ? 9 : n;
+    memcpy(p, kNops[len - 1], len);
+    p += len;
+    n -= len;
+  }
+}
+
+// Jumps and alignment padding are ordered by their keys. Padding is keyed by
+// its end, so it sorts before the key of a jump following it, and positions
+// are translated by the accumulated size change of all jumps and padding with
+// keys below twice the position. Labels bound at the end of padding are
+// thereby moved past the padding, and labels inside the original padding stay
+// inside it.
+static int JumpKey(int pos) { return pos * 2; }
+static int AlignKey(int pos) { return pos * 2 - 1; }
+
+int CodeGenerator::Translate(int pos) const {
+  if (ranges_.size() > 1) pos = SectionPosition(pos);
+
+  // Find the number of jumps and padding before the position.
+  auto it = std::lower_bound(relax_keys_.begin(), relax_keys_.end(), pos * 2);
+  int index = it - relax_keys_.begin();
+  return index > 0 ? pos + relax_delta_[index - 1] : pos;
+}
+
+// Writer for DWARF call frame information.
+class FrameWriter {
+ public:
+  explicit FrameWriter(std::vector<byte> *data) : data_(data) {}
+
+  int size() const { return data_->size(); }
+
+  void Byte(int value) { data_->push_back(value); }
+
+  void Fixed(uint64_t value, int size) {
+    for (int i = 0; i < size; ++i) Byte((value >> (i * 8)) & 0xFF);
+  }
+
+  void Patch(int pos, uint32_t value) {
+    for (int i = 0; i < 4; ++i) (*data_)[pos + i] = (value >> (i * 8)) & 0xFF;
+  }
+
+  void ULEB128(uint64_t value) {
+    do {
+      byte b = value & 0x7F;
+      value >>= 7;
+      if (value != 0) b |= 0x80;
+      Byte(b);
+    } while (value != 0);
+  }
+
+  void SLEB128(int64_t value) {
+    bool more = true;
+    while (more) {
+      byte b = value & 0x7F;
+      value >>= 7;
+      if ((value == 0 && (b & 0x40) == 0) || (value == -1 && (b & 0x40) != 0)) {
+        more = false;
+      } else {
+        b |= 0x80;
+      }
+      Byte(b);
+    }
+  }
+
+  // Pad entry starting at pos with nops so the next entry is aligned.
+  void Pad(int pos) {
+    while ((size() - pos) % 8 != 0) Byte(kNop);
+    Patch(pos, size() - pos - 4);
+  }
+
+  // Advance location in code.
+  void Advance(int delta) {
+    if (delta == 0) return;
+    if (delta < 0x40) {
+      Byte(kAdvanceLoc | delta);
+    } else if (delta < 0x100) {
+      Byte(kAdvanceLoc1);
+      Fixed(delta, 1);
+    } else if (delta < 0x10000) {
+      Byte(kAdvanceLoc2);
+      Fixed(delta, 2);
+    } else {
+      Byte(kAdvanceLoc4);
+      Fixed(delta, 4);
+    }
+  }
+
+  // DWARF call frame instructions.
+  static const int kNop = 0x00;
+  static const int kAdvanceLoc = 0x40;
+  static const int kOffset = 0x80;
+  static const int kRestore = 0xC0;
+  static const int kAdvanceLoc1 = 0x02;
+  static const int kAdvanceLoc2 = 0x03;
+  static const int kAdvanceLoc4 = 0x04;
+  static const int kRememberState = 0x0A;
+  static const int kRestoreState = 0x0B;
+  static const int kDefCfa = 0x0C;
+  static const int kDefCfaRegister = 0x0D;
+  static const int kDefCfaOffset = 0x0E;
+
+  // Pointer encodings.
+  static const int kAbsPtr = 0x00;
+  static const int kPcRelSData4 = 0x1B;
+
+  // DWARF register numbers.
+  static const int kStackPointer = 7;
+  static const int kReturnAddress = 16;
+
+ private:
+  std::vector<byte> *data_;
+};
+
+bool CodeGenerator::BuildUnwindInfo(std::vector<byte> *eh_frame,
+                                    uint64_t code_address,
+                                    uint64_t eh_frame_address,
+                                    bool pcrel) const {
+  if (frame_ops_.empty() || ranges_.size() > 1) return false;
+  eh_frame->clear();
+  FrameWriter w(eh_frame);
+
+  // Common information entry. On entry, the CFA is the stack pointer before
+  // the call, i.e. rsp + 8, and the return address is saved just below it.
+  int cie = w.size();
+  w.Fixed(0, 4);
+  w.Fixed(0, 4);
+  w.Byte(1);
+  w.Byte('z');
+  w.Byte('R');
+  w.Byte(0);
+  w.ULEB128(1);
+  w.SLEB128(-8);
+  w.ULEB128(FrameWriter::kReturnAddress);
+  w.ULEB128(1);
+  w.Byte(pcrel ? FrameWriter::kPcRelSData4 : FrameWriter::kAbsPtr);
+  w.Byte(FrameWriter::kDefCfa);
+  w.ULEB128(FrameWriter::kStackPointer);
+  w.ULEB128(8);
+  w.Byte(FrameWriter::kOffset | FrameWriter::kReturnAddress);
+  w.ULEB128(1);
+  w.Pad(cie);
+
+  // Frame description entry for the code.
+  int fde = w.size();
+  w.Fixed(0, 4);
+  w.Fixed(fde + 4 - cie, 4);
+  if (pcrel) {
+    w.Fixed(code_address - (eh_frame_address + w.size()), 4);
+    w.Fixed(pc_offset(), 4);
+  } else {
+    w.Fixed(code_address, 8);
+    w.Fixed(pc_offset(), 8);
+  }
+  w.ULEB128(0);
+
+  // Call frame instructions.
+  struct State { int reg; int offset; };
+  State cfa = {FrameWriter::kStackPointer, 8};
+  std::vector<State> saved;
+  int loc = 0;
+  for (const FrameChange &change : frame_ops_) {
+    int pos = Translate(change.pos);
+    w.Advance(pos - loc);
+    loc = pos;
+    switch (change.op) {
+      case kDefineCfa:
+        if (change.reg != cfa.reg && change.offset != cfa.offset) {
+          w.Byte(FrameWriter::kDefCfa);
+          w.ULEB128(change.reg);
+          w.ULEB128(change.offset);
+        } else if (change.reg != cfa.reg) {
+          w.Byte(FrameWriter::kDefCfaRegister);
+          w.ULEB128(change.reg);
+        } else if (change.offset != cfa.offset) {
+          w.Byte(FrameWriter::kDefCfaOffset);
+          w.ULEB128(change.offset);
+        }
+        cfa = {change.reg, change.offset};
+        break;
+      case kSaveRegister:
+        w.Byte(FrameWriter::kOffset | change.reg);
+        w.ULEB128(change.offset / 8);
+        break;
+      case kRestoreRegister:
+        w.Byte(FrameWriter::kRestore | change.reg);
+        break;
+      case kRememberState:
+        w.Byte(FrameWriter::kRememberState);
+        saved.push_back(cfa);
+        break;
+      case kRestoreState:
+        w.Byte(FrameWriter::kRestoreState);
+        if (!saved.empty()) {
+          cfa = saved.back();
+          saved.pop_back();
+        }
+        break;
+    }
+  }
+  w.Pad(fde);
+
+  // Terminator.
+  w.Fixed(0, 4);
+  return true;
+}
+
+void CodeGenerator::Relax() {
+  const int kShortSize = 2;
+
+  // Jump or alignment padding that can change size.
+  struct Item {
+    int key;        // sort key for ordering jumps and padding
+    int start;      // original position
+    int size;       // original size
+    int fixup;      // fixup for jump displacement or -1 for padding
+    int alignment;  // alignment for padding
+    int offset;     // offset of aligned position after padding
+    bool code;      // code padding
+    bool jcc;       // conditional jump
+    byte cc;        // condition code for conditional jump
+  };
+
+  // Collect the jumps to bound labels from the fixup table and the alignment
+  // padding, and sort these in code order. Jumps to bound labels can have been
+  // emitted in either short or long form.
+  std::vector<Item> items;
+  for (const Align &a : aligns_) {
+    items.push_back({AlignKey(a.pos + a.size), a.pos, a.size, -1,
+                     a.alignment, a.offset, a.code, false, 0});
+  }
+  for (int i = 0; i < static_cast<int>(fixups_.size()); ++i) {
+    const Fixup &f = fixups_[i];
+    if (f.target < 0) continue;
+    Item item = {0, 0, 0, i, 0, 0, false, false, 0};
+    if (f.kind == kJump8) {
+      item.start = f.pos - 1;
+      item.jcc = byte_at(item.start) != 0xEB;
+      item.cc = byte_at(item.start) & 0x0F;
+    } else if (f.kind == kJump32) {
+      if (byte_at(f.pos - 1) == 0xE9) {
+        item.start = f.pos - 1;
+      } else {
+        item.start = f.pos - 2;
+        item.jcc = true;
+        item.cc = byte_at(f.pos - 1) & 0x0F;
+      }
+    } else {
+      continue;
+    }
+    item.key = JumpKey(item.start);
+    item.size = f.pos - item.start + (f.kind == kJump8 ? 1 : 4);
+    items.push_back(item);
+  }
+  std::stable_sort(items.begin(), items.end(),
+                   [](const Item &a, const Item &b) { return a.key < b.key; });
+  std::vector<int> keys;
+  for (const Item &item : items) keys.push_back(item.key);
+  int n = items.size();
+
+  // Iteratively shrink jumps until no more jumps can be shrunk. Jumps start
+  // out in long form, and only get shorter. Alignment padding can grow when
+  // code shrinks, so a shrunk jump might no longer reach its target. Such
+  // jumps are pinned to their long form, and the relaxation is repeated.
+  std::vector<int> pos(n);
+  std::vector<int> length(n);
+  std::vector<int> delta(n);
+  std::vector<bool> shrink(n);
+  std::vector<bool> pinned(n);
+  auto translate = [&](int p) {
+    int index = std::lower_bound(keys.begin(), keys.end(), p * 2) -
+                keys.begin();
+    return index > 0 ? p + delta[index - 1] : p;
+  };
+  auto target = [&](int i) { return fixups_[items[i].fixup].target; };
+  for (;;) {
+    // Lay out code with the current jump sizes.
+    int accumulated = 0;
+    for (int i = 0; i < n; ++i) {
+      const Item &item = items[i];
+      pos[i] = item.start + accumulated;
+      if (item.fixup != -1) {
+        length[i] = shrink[i] ? kShortSize : (item.jcc ? 6 : 5);
       } else {
-        // Relative address, relative to point after address.
-        int imm32 = pos - (current + sizeof(int32_t) + sl);
-        long_at_put(current, imm32);
+        length[i] = -(pos[i] + item.offset) & (item.alignment - 1);
       }
-      current = next;
-      next = long_at(next);
-      sl = 0;
-      if (next < 0) {
-        sl = 1;
-        next = -next;
+      accumulated += length[i] - item.size;
+      delta[i] = accumulated;
+    }
+
+    // Shrink jumps that can reach their target with a short displacement.
+    bool changed = false;
+    for (int i = 0; i < n; ++i) {
+      if (items[i].fixup == -1 || shrink[i] || pinned[i]) continue;
+      if (is_int8(translate(target(i)) - (pos[i] + kShortSize))) {
+        shrink[i] = true;
+        changed = true;
       }
     }
-    // Fix up last fixup on linked list.
-    if (current >= 4 && long_at(current - 4) == 0) {
-      // Absolute address.
-      intptr_t imm64 = reinterpret_cast<intptr_t>(buffer_ + pos);
-      *reinterpret_cast<intptr_t *>(addr_at(current - 4)) = imm64;
-      refs_.push_back(current - 4);
+    if (changed) continue;
+
+    // Check that all shrunk jumps can still reach their targets.
+    bool valid = true;
+    for (int i = 0; i < n; ++i) {
+      if (items[i].fixup == -1 || !shrink[i]) continue;
+      if (!is_int8(translate(target(i)) - (pos[i] + kShortSize))) {
+        shrink[i] = false;
+        pinned[i] = true;
+        valid = false;
+      }
+    }
+    if (valid) break;
+  }
+
+  // Make sure the relaxed code fits in the code buffer.
+  int old_size = pc_offset();
+  int new_size = translate(old_size);
+  if (segmented_) {
+    Flatten(new_size + kMaximumInstructionSize);
+  } else {
+    if (buffer_size_ < new_size + kMaximumInstructionSize) {
+      GrowBuffer(new_size - old_size);
+    }
+  }
+
+  // Generate relaxed code into a new buffer and update the jump fixups.
+  byte *code = static_cast<byte *>(malloc(new_size + 1));
+  byte *out = code;
+  int cursor = 0;
+  std::vector<bool> done(fixups_.size());
+  for (int i = 0; i < n; ++i) {
+    const Item &item = items[i];
+    memcpy(out, buffer_ + cursor, item.start - cursor);
+    out += item.start - cursor;
+    if (item.fixup != -1) {
+      Fixup &f = fixups_[item.fixup];
+      if (shrink[i]) {
+        *out++ = item.jcc ? 0x70 | item.cc : 0xEB;
+        f.kind = kJump8;
+      } else {
+        if (item.jcc) {
+          *out++ = 0x0F;
+          *out++ = 0x80 | item.cc;
+        } else {
+          *out++ = 0xE9;
+        }
+        f.kind = kJump32;
+      }
+      f.pos = out - code;
+      f.target = translate(f.target);
+      int64_t disp = FixupValue(f);
+      if (shrink[i]) {
+        *out++ = static_cast<int8_t>(disp);
+      } else {
+        *reinterpret_cast<int32_t *>(out) = disp;
+        out += sizeof(int32_t);
+      }
+      done[item.fixup] = true;
+    } else if (item.code) {
+      FillNops(out, length[i]);
+      out += length[i];
     } else {
-      // Relative address, relative to point after address.
-      int imm32 = pos - (current + sizeof(int32_t) + sl);
-      long_at_put(current, imm32);
-    }
-  }
-  while (l->is_near_linked()) {
-    int fixup_pos = l->near_link_pos();
-    int offset_to_next =
-        static_cast<int>(*reinterpret_cast<int8_t *>(addr_at(fixup_pos)));
-    // DCHECK(offset_to_next <= 0);
-    int disp = pos - (fixup_pos + sizeof(int8_t));
-    // CHECK(is_int8(disp));
-    set_byte_at(fixup_pos, disp);
-    if (offset_to_next < 0) {
-      l->link_to(fixup_pos + offset_to_next, Label::kNear);
+      memset(out, 0, length[i]);
+      out += length[i];
+    }
+    cursor = item.start + item.size;
+  }
+  memcpy(out, buffer_ + cursor, old_size - cursor);
+
+  // Update the remaining label references.
+  for (size_t i = 0; i < fixups_.size(); ++i) {
+    if (done[i]) continue;
+    Fixup &f = fixups_[i];
+    f.pos = translate(f.pos);
+    if (f.kind == kOffset32) f.arg = translate(f.arg);
+    if (f.target < 0) continue;
+    f.target = translate(f.target);
+    int64_t value = FixupValue(f);
+    if (f.kind == kAbs64) {
+      *reinterpret_cast<int64_t *>(code + f.pos) = value;
     } else {
-      l->UnuseNear();
+      *reinterpret_cast<int32_t *>(code + f.pos) = value;
     }
   }
-  l->bind_to(pos);
+  for (int &p : refs_) p = translate(p);
+
+  // Update pc-relative references to external addresses.
+  for (int &p : pcrel_) {
+    int moved = translate(p);
+    *reinterpret_cast<int32_t *>(code + moved) -= moved - p;
+    p = moved;
+  }
+  for (SharedRef &r : shared_refs_) r.pos = translate(r.pos);
+
+  // Update positions of external references.
+  for (Extern &e : externs_) {
+    for (int &p : e.refs) p = translate(p);
+    for (int &p : e.calls) p = translate(p);
+    for (int &p : e.slot_refs) p = translate(p);
+  }
+  memcpy(buffer_, code, new_size);
+  pc_ = buffer_ + new_size;
+  free(code);
+
+  // Keep the position mapping for translating label positions.
+  relax_keys_.swap(keys);
+  relax_delta_.swap(delta);
+  aligns_.clear();
 }
 
-void CodeGenerator::AddExtern(const std::string &symbol, Address address) {
-  // Try to find existing external reference.
-  int index = -1;
-  for (int i = 0; i < externs_.size(); ++i) {
-    if (address == externs_[i].address) {
-      index = i;
-      break;
+void CodeGenerator::set_section(int section) {
+  // DCHECK(!finalized_);
+  if (section == section_) return;
+  if (ranges_.empty()) ranges_.push_back({0, section_, 0});
+
+  // End the current range with a placeholder for labels bound at the end of
+  // the range.
+  if (buffer_overflow()) GrowBuffer();
+  *pc_++ = 0xCC;
+  int pos = pc_offset();
+  ranges_.push_back({pos, section, pos});
+  section_ = section;
+}
+
+int CodeGenerator::SectionPosition(int pos) const {
+  // Find last range starting at or before position.
+  auto it = std::upper_bound(ranges_.begin(), ranges_.end(), pos,
+      [](int pos, const SectionRange &r) { return pos < r.start; });
+  const SectionRange &range = *(it - 1);
+  return range.moved + (pos - range.start);
+}
+
+void CodeGenerator::LayoutSections() {
+  // Concatenate chunks, so the code can be rearranged in one buffer.
+  if (!chunks_.empty()) Flatten(0);
+
+  // Assign the ranges to their final positions in section order. The
+  // placeholders at the end of the ranges are dropped.
+  int size = pc_offset();
+  int num_ranges = ranges_.size();
+  std::vector<int> order(num_ranges);
+  for (int i = 0; i < num_ranges; ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+    return ranges_[a].section < ranges_[b].section;
+  });
+  auto length = [&](int i) {
+    int end = i + 1 < num_ranges ? ranges_[i + 1].start - 1 : size;
+    return end - ranges_[i].start;
+  };
+  int new_size = 0;
+  for (int i : order) {
+    ranges_[i].moved = new_size;
+    new_size += length(i);
+  }
+
+  // Move the code for the ranges into a new buffer.
+  byte *code = static_cast<byte *>(malloc(size + 1));
+  for (int i = 0; i < num_ranges; ++i) {
+    memcpy(code + ranges_[i].moved, buffer_ + ranges_[i].start, length(i));
+  }
+
+  // Update the positions of all references. The references to labels are
+  // not patched here, since the code is relaxed after the layout anyway.
+  for (Fixup &f : fixups_) {
+    f.pos = SectionPosition(f.pos);
+    if (f.kind == kOffset32) f.arg = SectionPosition(f.arg);
+    if (f.target >= 0) f.target = SectionPosition(f.target);
+  }
+  for (Align &a : aligns_) a.pos = SectionPosition(a.pos);
+  for (int &p : refs_) p = SectionPosition(p);
+  for (int &p : pcrel_) {
+    int moved = SectionPosition(p);
+    *reinterpret_cast<int32_t *>(code + moved) -= moved - p;
+    p = moved;
+  }
+  for (SharedRef &r : shared_refs_) r.pos = SectionPosition(r.pos);
+  for (Extern &e : externs_) {
+    for (int &p : e.refs) p = SectionPosition(p);
+    for (int &p : e.calls) p = SectionPosition(p);
+    for (int &p : e.slot_refs) p = SectionPosition(p);
+  }
+  memcpy(buffer_, code, new_size);
+  pc_ = buffer_ + new_size;
+  free(code);
+}
+
+void CodeGenerator::Finalize() {
+  if (!finalized_) {
+    // Code from multiple sections is always relaxed, since jumps between
+    // sections can have been emitted with displacements that no longer fit
+    // after the layout.
+    if (ranges_.size() > 1) {
+      LayoutSections();
+      Relax();
+    } else if (relax_) {
+      Relax();
     }
   }
+  finalized_ = true;
+  FlushConstants();
 
-  // Add new external symbol.
-  if (index == -1) {
-    index = externs_.size();
-    externs_.emplace_back(symbol, address);
+  // Add slots with the addresses of external symbols referenced through
+  // slots. The slots are aligned, so they can be updated atomically.
+  for (Extern &e : externs_) {
+    if (e.slot_refs.empty() || e.slot != -1) continue;
+    while ((pc_offset() & (sizeof(Address) - 1)) != 0) {
+      if (buffer_overflow()) GrowBuffer();
+      *pc_++ = 0;
+    }
+    if (buffer_overflow()) GrowBuffer();
+    e.slot = pc_offset();
+    *reinterpret_cast<Address *>(pc_) = e.address;
+    e.refs.push_back(e.slot);
+    pc_ += sizeof(Address);
+    for (int pos : e.slot_refs) {
+      long_at_put(pos, e.slot - (pos + sizeof(int32_t)));
+    }
   }
 
-  // Add reference to external symbol.
-  externs_[index].refs.push_back(pc_offset());
+  for (Extern &e : externs_) {
+    if (e.calls.empty() || e.veneer != -1) continue;
+
+    // Code generated in place is already at its final address, so only
+    // unreachable calls need a veneer. Otherwise, the final address is not
+    // known yet.
+    bool reachable = false;
+    if (in_place()) {
+      reachable = true;
+      for (int pos : e.calls) {
+        Address source = origin_ + pos + sizeof(int32_t);
+        if (!is_int32(e.address - source)) reachable = false;
+      }
+    }
+    if (reachable) continue;
+
+    // Add veneer with an indirect jump through the absolute address of the
+    // symbol (jmp [rip+0]; dq address).
+    if (buffer_overflow()) GrowBuffer();
+    e.veneer = pc_offset();
+    static const byte veneer[] = {0xFF, 0x25, 0x00, 0x00, 0x00, 0x00};
+    memcpy(pc_, veneer, sizeof(veneer));
+    pc_ += sizeof(veneer);
+    *reinterpret_cast<Address *>(pc_) = e.address;
+    e.refs.push_back(pc_offset());
+    pc_ += sizeof(Address);
+  }
+
+  // Calls in segmented code are resolved when the chunks are concatenated.
+  if (chunks_.empty()) ResolveCalls(buffer_, origin_);
+}
+
+void CodeGenerator::ResolveCalls(byte *dst, Address origin) const {
+  for (const Extern &e : externs_) {
+    for (int pos : e.calls) {
+      // Call target directly if it is within reach; otherwise call veneer.
+      int32_t *disp = reinterpret_cast<int32_t *>(dst + pos);
+      intptr_t direct = e.address - (origin + pos + sizeof(int32_t));
+      if (is_int32(direct)) {
+        *disp = direct;
+      } else if (e.veneer != -1) {
+        *disp = e.veneer - (pos + sizeof(int32_t));
+      }
+    }
+  }
+}
+
+void CodeGenerator::CopyTo(byte *dst, Address origin) const {
+  for (const Chunk &chunk : chunks_) {
+    memcpy(dst + chunk.offset, chunk.data, chunk.size);
+  }
+  memcpy(dst + chunk_offset_, buffer_, pc_ - buffer_);
+  Relocate(dst, origin);
 }
 
-Code::Code(void *code, int size) : memory_(nullptr), size_(0) {
+void CodeGenerator::Relocate(byte *dst, Address origin) const {
+  // Internal references are absolute addresses into the code, and external
+  // references are relative to the position in the code, so these need to be
+  // adjusted when the code is moved.
+  intptr_t delta = origin - origin_;
+  if (delta == 0) return;
+  for (auto pos : refs_) {
+    *reinterpret_cast<intptr_t *>(dst + pos) += delta;
+  }
+  for (auto pos : pcrel_) {
+    *reinterpret_cast<int32_t *>(dst + pos) -= delta;
+  }
+  ResolveCalls(dst, origin);
+}
+
+void CodeGenerator::Load(const void *code, int size,
+                         const std::vector<int> &refs,
+                         const std::vector<Extern> &externs) {
+  Reset();
+  Reserve(size);
+  memcpy(pc_, code, size);
+  pc_ += size;
+
+  // Make internal references absolute.
+  for (int pos : refs) {
+    *reinterpret_cast<int64_t *>(addr_at(pos)) +=
+        reinterpret_cast<int64_t>(origin_);
+    refs_.push_back(pos);
+  }
+
+  // Fill in the addresses of the external symbols.
+  for (const Extern &e : externs) {
+    Extern &ext = externs_[FindExtern(e.symbol, e.address)];
+    for (int pos : e.refs) {
+      *reinterpret_cast<Address *>(addr_at(pos)) = e.address;
+      ext.refs.push_back(pos);
+    }
+    ext.calls.insert(ext.calls.end(), e.calls.begin(), e.calls.end());
+    ext.slot = e.slot;
+    ext.veneer = e.veneer;
+  }
+  finalized_ = true;
+}
+
+Code::Code(void *code, int size)
+    : memory_(nullptr), size_(0), heap_(nullptr) {
   Allocate(code, size);
 }
 
+Code::Code(CodeHeap *heap, void *code, int size)
+    : memory_(nullptr), size_(0), heap_(nullptr) {
+  Allocate(heap, code, size);
+}
+
+Code::Code(CodeGenerator *generator)
+    : memory_(nullptr), size_(0), heap_(nullptr) {
+  Allocate(generator);
+}
+
+Code::Code(CodeHeap *heap, CodeGenerator *generator)
+    : memory_(nullptr), size_(0), heap_(nullptr) {
+  Allocate(heap, generator);
+}
+
+bool Code::SetSlot(int offset, const void *address) {
+  return Store(offset, reinterpret_cast<uintptr_t>(address),
+               sizeof(uintptr_t));
+}
+
+// Serialize instruction execution on all processors running threads of the
+// process, so code patched by another thread takes effect everywhere. This
+// is a no-op if the kernel does not support it.
+static void SyncCores() {
+  static const bool registered =
+      syscall(__NR_membarrier,
+              MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0;
+  if (registered) {
+    syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+  }
+}
+
+bool Code::Patch32(int offset, int32_t value) {
+  if (!Store(offset, static_cast<uint32_t>(value), sizeof(int32_t))) {
+    return false;
+  }
+  SyncCores();
+  return true;
+}
+
+bool Code::Patch64(int offset, int64_t value) {
+  if (!Store(offset, value, sizeof(int64_t))) return false;
+  SyncCores();
+  return true;
+}
+
+bool Code::PatchCall(int offset, const void *target) {
+  Address source = memory_ + offset + sizeof(int32_t);
+  intptr_t displacement = static_cast<const byte *>(target) - source;
+  if (!is_int32(displacement)) return false;
+  return Patch32(offset, displacement);
+}
+
+// Serializes patching of code blocks without a code heap, so one thread
+// cannot remove write permissions from a page while another thread is
+// storing to it.
+static std::mutex patch_mu;
+
+bool Code::Store(int offset, uint64_t value, int size) {
+  // DCHECK(offset % size == 0);
+  Address location = memory_ + offset;
+  Address writable;
+  void *page = nullptr;
+  std::unique_lock<std::mutex> lock(patch_mu, std::defer_lock);
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  if (heap_ != nullptr) {
+    writable = heap_->Reopen(location);
+  } else {
+    // Make the page writable while keeping it executable.
+    lock.lock();
+    uintptr_t addr = reinterpret_cast<uintptr_t>(location);
+    page = reinterpret_cast<void *>(addr & ~(page_size - 1));
+    if (mprotect(page, page_size, PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
+      return false;
+    }
+    writable = location;
+  }
+  if (size == sizeof(uint64_t)) {
+    __atomic_store_n(reinterpret_cast<uint64_t *>(writable), value,
+                     __ATOMIC_RELEASE);
+  } else {
+    __atomic_store_n(reinterpret_cast<uint32_t *>(writable), value,
+                     __ATOMIC_RELEASE);
+  }
+  if (heap_ != nullptr) {
+    heap_->Commit(location);
+  } else {
+    int rc = mprotect(page, page_size, PROT_READ | PROT_EXEC);
+    // CHECK_EQ(rc, 0);
+    (void) rc;
+  }
+  return true;
+}
+
+std::string CodeObserver::CodeName(const Code &code,
+                                   const CodeGenerator *generator) {
+  if (generator != nullptr && !generator->name().empty()) {
+    return generator->name();
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "jit_%p", code.begin());
+  return name;
+}
+
+// Registered code observers.
+static std::mutex observers_mu;
+static std::vector<CodeObserver *> observers;
+static std::atomic<int> num_observers{0};
+
+void Code::AddObserver(CodeObserver *observer) {
+  std::lock_guard<std::mutex> lock(observers_mu);
+  observers.push_back(observer);
+  num_observers = observers.size();
+}
+
+void Code::RemoveObserver(CodeObserver *observer) {
+  std::lock_guard<std::mutex> lock(observers_mu);
+  observers.erase(std::remove(observers.begin(), observers.end(), observer),
+                  observers.end());
+  num_observers = observers.size();
+}
+
 Code::~Code() {
-  if (memory_ != nullptr) munmap(memory_, size_);
+  if (memory_ == nullptr) return;
+  if (num_observers > 0) {
+    std::lock_guard<std::mutex> lock(observers_mu);
+    for (CodeObserver *observer : observers) observer->Removed(*this);
+  }
+  if (!eh_frame_.empty()) __deregister_frame(eh_frame_.data());
+  if (heap_ != nullptr) {
+    heap_->Free(memory_, size_);
+  } else {
+    munmap(memory_, size_);
+  }
 }
 
-void Code::Allocate(void *code, int size) {
-  // Allocate r/w memory.
+void Code::Install(CodeHeap *heap, void *code, int size,
+                   CodeGenerator *generator) {
+  Place(heap, code, size, generator);
+
+  // Register unwind information for the code.
+  if (memory_ != nullptr && generator != nullptr &&
+      generator->unwind_info()) {
+    uint64_t address = reinterpret_cast<uint64_t>(memory_);
+    if (generator->BuildUnwindInfo(&eh_frame_, address, 0, false)) {
+      __register_frame(eh_frame_.data());
+    }
+  }
+
+  if (memory_ != nullptr && num_observers > 0) {
+    std::lock_guard<std::mutex> lock(observers_mu);
+    for (CodeObserver *observer : observers) {
+      observer->Installed(*this, generator);
+    }
+  }
+}
+
+void Code::Place(CodeHeap *heap, void *code, int size,
+                 CodeGenerator *generator) {
   // CHECK(memory_ == nullptr);
+  if (generator != nullptr && generator->in_place()) {
+    // Take ownership of code generated in place.
+    heap_ = generator->heap();
+    size_ = size;
+    memory_ = generator->Commit();
+    return;
+  }
+
+  if (heap != nullptr) {
+    // Allocate block in code heap and write the code through the writable
+    // view of the block before committing it.
+    memory_ = heap->Allocate(size);
+    // CHECK(memory_ != nullptr);
+    if (memory_ == nullptr) return;
+
+    // Place copies of the shared constants after the code if the code cannot
+    // reach them from the block.
+    bool local = generator != nullptr &&
+                 !generator->SharedConstantsReachable(memory_);
+    if (local) {
+      // Commit the block before freeing it to release its writer.
+      heap->Commit(memory_);
+      heap->Free(memory_, size);
+      size = generator->LocalConstantsSize();
+      memory_ = heap->Allocate(size);
+      if (memory_ == nullptr) return;
+    }
+    heap_ = heap;
+    size_ = size;
+    byte *dst = heap->Writable(memory_);
+    if (generator != nullptr) {
+      generator->CopyTo(dst, memory_);
+      if (local) generator->CopyLocalConstants(dst);
+    } else {
+      memcpy(dst, code, size);
+    }
+    heap->Commit(memory_);
+    return;
+  }
+
+  // Allocate r/w memory.
   memory_ = static_cast<byte *>(
                 mmap(nullptr, size,
                      PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
@@ -186,8 +1350,26 @@ void Code::Allocate(void *code, int size) {
   // CHECK(memory_ != nullptr);
   size_ = size;
 
+  // Place copies of the shared constants after the code if the code cannot
+  // reach them from the mapping.
+  bool local = generator != nullptr &&
+               !generator->SharedConstantsReachable(memory_);
+  if (local) {
+    munmap(memory_, size_);
+    size_ = generator->LocalConstantsSize();
+    memory_ = static_cast<byte *>(
+                  mmap(nullptr, size_,
+                       PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+                       0, 0));
+  }
+
   // Copy code block to allocated memory.
-  memcpy(memory_, code, size);
+  if (generator != nullptr) {
+    generator->CopyTo(memory_, memory_);
+    if (local) generator->CopyLocalConstants(memory_);
+  } else {
+    memcpy(memory_, code, size);
+  }
 
   // Make code executable and remove write permissions.
   int rc = mprotect(memory_, size_, PROT_READ | PROT_EXEC);
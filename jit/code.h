@@ -36,10 +36,15 @@
 #ifndef JIT_CODE_H_
 #define JIT_CODE_H_
 
+#include <assert.h>
+#include <stdint.h>
 #include <deque>
+#include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "jit/heap.h"
 #include "jit/memory.h"
 
 namespace sling {
@@ -48,75 +53,71 @@ namespace jit {
 // Labels represent pc locations; they are typically jump or call targets.
 // After declaration, a label can be freely used to denote known or (yet)
 // unknown pc location. CodeGenerator::bind() is used to bind a label to the
-// current pc. A label can be bound only once.
+// current pc. A label can be bound only once. References to a label that is
+// not bound yet are recorded in the fixup table of the code generator and
+// resolved when the label is bound.
 class Label {
  public:
   enum Distance {
     kNear, kFar
   };
 
-  inline Label() {
-    Unuse();
-    UnuseNear();
-  }
+  inline Label() { Unuse(); }
 
   inline ~Label() {
     // DCHECK(!is_linked());
-    // DCHECK(!is_near_linked());
   }
 
   inline void Unuse() { pos_ = 0; }
-  inline void UnuseNear() { near_link_pos_ = 0; }
 
   inline bool is_bound() const { return pos_ <  0; }
-  inline bool is_unused() const { return pos_ == 0 && near_link_pos_ == 0; }
+  inline bool is_unused() const { return pos_ == 0; }
   inline bool is_linked() const { return pos_ >  0; }
-  inline bool is_near_linked() const { return near_link_pos_ > 0; }
 
-  // Returns the position of bound or linked labels. Cannot be used
-  // for unused labels.
+  // Returns the position of bound labels. Cannot be used for unbound labels.
   int pos() const;
-  int near_link_pos() const { return near_link_pos_ - 1; }
 
   void bind_to(int pos)  {
     pos_ = -pos - 1;
     // DCHECK(is_bound());
   }
 
-  void link_to(int pos, Distance distance = kFar) {
-    if (distance == kNear) {
-      near_link_pos_ = pos + 1;
-      // DCHECK(is_near_linked());
-    } else {
-      pos_ = pos + 1;
-      // DCHECK(is_linked());
-    }
-  }
-
  private:
   // pos_ encodes both the binding state (via its sign)
   // and the binding position (via its value) of a label.
   //
   // pos_ <  0  bound label, pos() returns the jump target position
   // pos_ == 0  unused label
-  // pos_ >  0  linked label, pos() returns the last reference position
+  // pos_ >  0  linked label, pos_ - 1 is the index of the last fixup for the
+  //            label in the fixup table
   int pos_;
 
-  // Behaves like |pos_| in the "> 0" case, but for near jumps to this label.
-  int near_link_pos_;
-
   friend class CodeGenerator;
 };
 
 // An external symbol is a reference to code or data outside the code buffer
-// of the code generator.
+// of the code generator. References are either absolute 64-bit addresses or
+// rel32 calls. Calls that cannot reach the symbol directly go through a
+// veneer, which jumps to the symbol through an absolute address. With extern
+// slots, all loads of and calls to the symbol go through a single slot with
+// the address of the symbol, which is placed after the code.
+//
+// Symbol names are interned in a symbol table shared by all code generators,
+// so each name is only stored once.
 struct Extern {
-Extern(const std::string &symbol, Address address)
+  Extern(const char *symbol, Address address)
       : symbol(symbol), address(address) {}
 
-  std::string symbol;           // symbolic name of external reference
-  Address address;         // address of external reference
-  std::vector<int> refs;   // offsets of references to symbol in code buffer
+  // Return interned symbol name. Interned names are never deallocated.
+  static const char *Intern(const char *name);
+
+  const char *symbol;          // interned name of external reference
+  Address address;             // address of external reference
+  std::vector<int> refs;       // offsets of references to symbol in code
+  std::vector<int> calls;      // offsets of rel32 calls to symbol in code
+  std::vector<int> slot_refs;  // offsets of rel32 references to symbol slot
+  int veneer = -1;             // offset of veneer for calls to symbol
+  int slot = -1;               // offset of slot for symbol
 };
 
 // A code generator emits machine code instructons into a buffer. If the
@@ -127,29 +128,83 @@ Extern(const std::string &symbol, Address address)
 // provided buffer for code generation and assumes its size to be buffer_size.
 // If the buffer is too small, a fatal error occurs. No deallocation of the
 // buffer is done upon destruction of the code generator.
+//
+// The code generator can also emit code in place into a block reserved in a
+// code heap. The block is moved to a larger block in the heap if the code
+// outgrows it. The code is generated at its final address, so absolute
+// references and relative calls to external addresses need no relocation,
+// and the code can be committed to the heap without copying it.
+//
+// In segmented mode, a code generator that owns its buffer does not move the
+// code to a larger buffer when the buffer is full. Instead, code generation
+// continues in a new chunk, and the chunks are only concatenated when the code
+// is copied to its final location. Positions in the code are still contiguous
+// across chunks, and instructions never straddle chunk boundaries.
 class CodeGenerator {
  public:
   CodeGenerator(void *buffer, int buffer_size);
+  explicit CodeGenerator(CodeHeap *heap);
   ~CodeGenerator();
 
-  // Memory area for generated code.
-  byte *begin() { return buffer_; }
-  byte *end() { return pc_; }
+  // Memory area for generated code. In segmented mode, this concatenates the
+  // chunks into a single buffer.
+  byte *begin() {
+    if (!chunks_.empty()) Flatten(0);
+    return buffer_;
+  }
+  byte *end() {
+    if (!chunks_.empty()) Flatten(0);
+    return pc_;
+  }
   int size() { return pc_offset(); }
 
   // Current pc.
   Address pc() const { return pc_; }
 
+  // Address where the code buffer is going to be executed. For code generated
+  // in place in a code heap, this is the executable address of the code
+  // block; otherwise it is the address of the code buffer.
+  Address origin() const { return origin_; }
+
+  // Code heap for in-place code generation.
+  CodeHeap *heap() const { return heap_; }
+  bool in_place() const { return heap_ != nullptr; }
+
+  // Reset code generator for generating new code. The code buffer and the
+  // capacity of the internal tables are kept, so code generators can be
+  // reused without allocating memory. In segmented mode, only the last chunk
+  // is kept. Code generated in place that has been committed to the heap is
+  // replaced with a new block. Labels for the previous code become invalid.
+  // The code generation options, i.e. branch relaxation, segmented mode,
+  // extern slots, and unwind information, are restored to their defaults.
+  void Reset();
+
+  // Commit code generated in place to the code heap. The ownership of the code
+  // block is transferred to the caller, and the code generator can no longer
+  // be used. Returns the executable address of the code.
+  Address Commit();
+
   // Offset of pc in code buffer.
-  int pc_offset() const { return static_cast<int>(pc_ - buffer_); }
+  int pc_offset() const {
+    return chunk_offset_ + static_cast<int>(pc_ - buffer_);
+  }
 
   // Get the number of bytes available in the buffer.
   int available_space() const {
     return buffer_ + buffer_size_ - pc_;
   }
 
-  // Increase size of code buffer.
-  void GrowBuffer();
+  // Increase size of code buffer, or start a new chunk in segmented mode, so
+  // there is room for at least the requested space.
+  void GrowBuffer(int space = 0);
+
+  // Make sure there is room for emitting the given number of bytes without
+  // growing the code buffer.
+  void Reserve(int bytes);
+
+  // Enable segmented mode for code generators that own their code buffer.
+  void set_segmented(bool segmented) { segmented_ = segmented; }
+  bool segmented() const { return segmented_; }
 
   // Bind label to current pc.
   void bind(Label *l);
@@ -159,14 +214,15 @@ class CodeGenerator {
 
   // Check if there is not enough space available in the code buffer for
   // emitting one more instruction.
-  bool buffer_overflow() const {
-    return pc_ + kMaximumInstructionSize > buffer_ + buffer_size_;
-  }
+  bool buffer_overflow() const { return pc_ > limit_; }
 
   // Get and set bytes in the code buffer.
-  byte byte_at(int pos) { return buffer_[pos]; }
-  void set_byte_at(int pos, byte value) { buffer_[pos] = value; }
-  byte *addr_at(int pos)  { return buffer_ + pos; }
+  byte *addr_at(int pos)  {
+    if (pos >= chunk_offset_) return buffer_ + (pos - chunk_offset_);
+    return ChunkAddress(pos);
+  }
+  byte byte_at(int pos) { return *addr_at(pos); }
+  void set_byte_at(int pos, byte value) { *addr_at(pos) = value; }
   uint32_t long_at(int pos) {
     return *reinterpret_cast<uint32_t *>(addr_at(pos));
   }
@@ -175,15 +231,322 @@ class CodeGenerator {
   }
 
   // Add external reference.
-  void AddExtern(const std::string &symbol, Address address);
+  void AddExtern(const char *symbol, Address address);
+
+  // Add rel32 call to external symbol.
+  void AddExternCall(const char *symbol, Address address);
+
+  // Add rel32 reference to the slot for external symbol.
+  void AddExternSlot(const char *symbol, Address address);
+
+  // Load and call external symbols through slots. All references to a symbol
+  // then go through one slot, so the symbol can be rebound by updating the
+  // slot with Code::SetSlot().
+  void set_extern_slots(bool extern_slots) { extern_slots_ = extern_slots; }
+  bool extern_slots() const { return extern_slots_; }
+
+  // Finalize generated code. This lays out the code sections, relaxes
+  // branches if branch relaxation is enabled, and adds veneers for external
+  // calls that are not known to be able to reach their targets directly.
+  // Calls are resolved to call the target directly, if possible, when the
+  // code is relocated. No more code can be generated after the code generator
+  // has been finalized.
+  void Finalize();
+
+  // Enable branch relaxation. All jumps to labels are then emitted in their
+  // long form regardless of the requested distance, and the code generator
+  // records all position-dependent references in the code. When the code is
+  // finalized, the jumps are shrunk to the shortest encoding that can reach
+  // their targets. This must be enabled before any code is generated.
+  void set_relax(bool relax) { relax_ = relax; }
+  bool relax() const { return relax_; }
+
+  // Translate position in the generated code to the position in the final
+  // code after section layout and branch relaxation. This can be used for
+  // translating label positions after the code has been finalized.
+  int Translate(int pos) const;
+
+  // Code sections. Code is emitted into the current section, and the sections
+  // are laid out in section order when the code is finalized, so all hot code
+  // is placed before all cold code. Labels can be used across sections, but
+  // code must not fall through from one section to another when switching
+  // sections. When more than one section is used, branches are relaxed for
+  // the final layout, even if branch relaxation is not enabled.
+  enum Section {
+    kHotSection = 0,   // code on the fast path
+    kColdSection = 1,  // slow paths, error exits, and other rarely run code
+  };
+
+  // Switch to section for emitting code.
+  void set_section(int section);
+  int section() const { return section_; }
+
+  // Name of generated code. The name is reported to code observers, e.g.
+  // profilers and debuggers, when the code is installed.
+  const std::string &name() const { return name_; }
+  void set_name(const std::string &name) { name_ = name; }
+
+  // Source line for generated code.
+  struct LineInfo {
+    int pos;           // position in generated code
+    int line;          // line number
+    std::string file;  // source file name
+  };
+
+  // Record that the code generated from the current position comes from a
+  // source line. Use Translate() for getting the position in the final code.
+  void AddLine(const char *file, int line) {
+    lines_.push_back({pc_offset(), line, file});
+  }
+
+  // Source lines for generated code.
+  const std::vector<LineInfo> &lines() const { return lines_; }
+
+  // Named range of generated code.
+  struct Symbol {
+    std::string name;  // symbol name
+    int begin;         // start position in generated code
+    int end;           // end position in generated code
+  };
+
+  // Add symbol for the code between two bound labels, e.g. for reporting the
+  // individual functions in a code object to debuggers. Use Translate() for
+  // getting the positions in the final code.
+  void AddSymbol(const std::string &name, Label *begin, Label *end) {
+    symbols_.push_back({name, begin->pos(), end->pos()});
+  }
+
+  // Symbols for generated code.
+  const std::vector<Symbol> &symbols() const { return symbols_; }
+
+  // Enable unwind information. The code generator then records how the
+  // stack frame changes in the generated code, so unwinders can walk the
+  // stack through the code, e.g. for propagating exceptions thrown by
+  // functions called from the code. The code must be a single function that
+  // starts with the return address on top of the stack. When the code is
+  // installed, its unwind information is registered with the unwinder. This
+  // must be enabled before any code is generated.
+  void set_unwind_info(bool unwind_info) { unwind_info_ = unwind_info; }
+  bool unwind_info() const { return unwind_info_; }
+
+  // Build .eh_frame section with a CIE and an FDE covering the final code,
+  // terminated by a zero entry. The code is assumed to be located at
+  // code_address and the section at eh_frame_address. The code address is
+  // encoded relative to the section if pcrel is true, and as an absolute
+  // address otherwise. Returns false if no unwind information has been
+  // recorded or if the code uses more than one section.
+  bool BuildUnwindInfo(std::vector<byte> *eh_frame, uint64_t code_address,
+                       uint64_t eh_frame_address, bool pcrel) const;
+
+  // Kinds of label references.
+  enum FixupKind {
+    kJump8,     // 8-bit jump displacement
+    kJump32,    // 32-bit jump displacement
+    kRel32,     // 32-bit displacement relative to the end of the instruction
+    kAbs64,     // 64-bit absolute address
+    kOffset32,  // 32-bit offset relative to a position in the code
+  };
+
+  // Add reference to label at the current position. The argument is the
+  // number of instruction bytes following a rel32 displacement, or the base
+  // position for a 32-bit offset. Returns the displacement or address to emit
+  // for the reference if the label is bound. Otherwise zero is returned, and
+  // the reference is resolved when the label is bound.
+  int64_t AddFixup(Label *label, FixupKind kind, int arg = 0);
+
+  // Record alignment padding at the current position, so it can be adjusted
+  // when the code is laid out. The padding aligns the position at the given
+  // offset after the padding. Code padding is filled with nops and data
+  // padding with zeros.
+  void AddAlign(int alignment, bool code, int offset = 0) {
+    int pos = pc_offset();
+    int size = -(pos + offset) & (alignment - 1);
+    aligns_.push_back({pos, size, alignment, offset, code});
+  }
+
+  // Add constant to the constant pool of the code generator and return the
+  // label for the constant. Identical constants with the same size are only
+  // stored once. The constants are placed after the code, aligned to their
+  // alignment, when the code is finalized.
+  Label *AddConstant(const void *data, int size, int alignment);
+
+  // Add pc-relative reference to an address outside the code buffer at the
+  // current position.
+  void AddRelative() { pcrel_.push_back(pc_offset()); }
+
+  // Add constant at an address outside the code buffer, e.g. in a shared
+  // constant pool. If the code is installed where it cannot reach the shared
+  // constants, copies of the constants are placed after the code instead.
+  void AddSharedConstant(Address address, const void *data, int size,
+                         int alignment);
+
+  // Record pc-relative reference at the current position to the target
+  // address if it is within a shared constant. The arg is the number of
+  // instruction bytes following the displacement.
+  void AddSharedReference(Address target, int arg);
+
+  // Check if all referenced shared constants can be reached from code at
+  // the origin address.
+  bool SharedConstantsReachable(Address origin) const;
+
+  // Size of code with copies of the shared constants placed after the code.
+  int LocalConstantsSize() const;
+
+  // Copy the shared constants to the end of the code at dst and redirect the
+  // references to the copies, so the code does not need to reach the shared
+  // constants.
+  void CopyLocalConstants(byte *dst) const;
+
+  // Copy generated code to destination and relocate internal references, so
+  // the code can be executed at the origin address.
+  void CopyTo(byte *dst, Address origin) const;
+
+  // Relocate references in code at dst from the current origin to a new
+  // origin.
+  void Relocate(byte *dst, Address origin) const;
 
   // List of external symbols in code buffer.
   const std::vector<Extern> &externs() const { return externs_; }
 
+  // Positions of absolute references to positions in the code.
+  const std::vector<int> &refs() const { return refs_; }
+
+  // Positions of pc-relative references to addresses outside the code.
+  const std::vector<int> &pcrel() const { return pcrel_; }
+
+  // Load finalized code, e.g. code saved by another process. The absolute
+  // references to positions in the code hold offsets from the start of the
+  // code, and the references to the external symbols are filled in with the
+  // addresses of the symbols. Calls to external symbols are resolved when the
+  // code is installed. The code generator is reset before loading the code,
+  // and no more code can be generated after it has been loaded.
+  void Load(const void *code, int size, const std::vector<int> &refs,
+            const std::vector<Extern> &externs);
+
   static const int kMinimalBufferSize = 4096;
   static const int kMaximumInstructionSize = 32;
+  static const int kMaximumChunkSize = 1 << 20;
 
  protected:
+  // Find external symbol or add a new one. Returns the index of the symbol.
+  int FindExtern(const char *symbol, Address address);
+
+  // Chunk of code in segmented mode.
+  struct Chunk {
+    byte *data;  // code in chunk
+    int offset;  // position of the first byte in the chunk
+    int size;    // number of bytes of code in the chunk
+  };
+
+  // Return address of position in a previous chunk.
+  byte *ChunkAddress(int pos);
+
+  // Concatenate chunks into a single code buffer that has room for at least
+  // capacity bytes.
+  void Flatten(int capacity);
+
+  // Update buffer limit after the code buffer has changed.
+  void UpdateLimit();
+
+  // Resolve external calls in code at dst to execute at origin.
+  void ResolveCalls(byte *dst, Address origin) const;
+
+  // Shrink jumps to their shortest encoding and update all position-dependent
+  // references in the code.
+  void Relax();
+
+  // Move the code for each section together, with the sections in section
+  // order, and update all position-dependent references in the code.
+  void LayoutSections();
+
+  // Translate position in the generated code to the position after section
+  // layout.
+  int SectionPosition(int pos) const;
+
+  // Range of code emitted into a section. Each range except the last one
+  // ends with a placeholder byte, which is dropped by the section layout.
+  // Labels bound just before switching sections are bound to the placeholder,
+  // so these are moved to the next range for their section.
+  struct SectionRange {
+    int start;    // start of range in generated code
+    int section;  // section for range
+    int moved;    // start of range after section layout
+  };
+
+  // Constant in constant pool.
+  struct Constant {
+    int offset;     // offset of constant in constant data
+    int size;       // size of constant
+    int alignment;  // alignment of constant
+  };
+
+  // Constant outside the code buffer, e.g. in a shared constant pool.
+  struct SharedConstant {
+    Address address;  // address of constant
+    int offset;       // offset of constant in shared constant data
+    int size;         // size of constant
+    int alignment;    // alignment of constant
+  };
+
+  // Pc-relative reference to a shared constant.
+  struct SharedRef {
+    int pos;       // position of displacement
+    int arg;       // instruction bytes following displacement
+    int constant;  // index of shared constant
+    int offset;    // offset of target in shared constant
+  };
+
+  // Emit constants in constant pool after the code.
+  void FlushConstants();
+
+  // Reference to a label in the code.
+  struct Fixup {
+    FixupKind kind;  // reference type
+    int pos;         // position of displacement or address
+    int arg;         // instruction bytes following displacement minus
+                     // offset from label, or base
+    int target;      // position of label, or -1 if label is not bound yet
+    int next;        // next unresolved reference to the same label or -1
+  };
+
+  // Alignment padding recorded for section layout and branch relaxation.
+  struct Align {
+    int pos;        // position of padding
+    int size;       // size of padding
+    int alignment;  // alignment of code following padding
+    int offset;     // offset of aligned position after padding
+    bool code;      // code or data padding
+  };
+
+  // Return displacement or address for resolved label reference.
+  int64_t FixupValue(const Fixup &fixup) const;
+
+  // Write resolved label reference into code buffer.
+  void Patch(const Fixup &fixup);
+
+  // Call frame changes for unwind information.
+  enum FrameOp {
+    kDefineCfa,       // CFA is register plus offset
+    kSaveRegister,    // register saved at offset below CFA
+    kRestoreRegister,  // register restored to its value on entry
+    kRememberState,   // push frame state
+    kRestoreState,    // pop frame state
+  };
+
+  // Record change to the call frame at the current position. Registers are
+  // DWARF register numbers.
+  void AddFrameOp(FrameOp op, int reg = 0, int offset = 0) {
+    if (unwind_info_) frame_ops_.push_back({pc_offset(), op, reg, offset});
+  }
+
+  // Recorded call frame change.
+  struct FrameChange {
+    int pos;     // position in generated code after the change
+    FrameOp op;  // frame operation
+    int reg;     // DWARF register number
+    int offset;  // offset from CFA
+  };
+
   // The buffer into which code is generated. It could either be owned by the
   // code generator or be provided externally.
   byte *buffer_;
@@ -193,13 +556,82 @@ class CodeGenerator {
   // The program counter, which points into the buffer above and moves forward.
   byte *pc_;
 
+  // The buffer must be grown before emitting an instruction beyond the limit.
+  // The limit is lifted while space is reserved.
+  byte *limit_;
+  int reservations_ = 0;
+
+  // Executable address of the code buffer. In segmented mode, this is the
+  // address of the first chunk.
+  Address origin_;
+
+  // Previous chunks in segmented mode. The current chunk is the code buffer,
+  // which starts at position chunk_offset_.
+  bool segmented_ = false;
+  std::vector<Chunk> chunks_;
+  int chunk_offset_ = 0;
+
+  // Code heap for in-place code generation.
+  CodeHeap *heap_;
+
   // Internal reference positions, required for (potential) patching in
   // GrowBuffer(); contains only those internal references whose labels
   // are already bound.
-  std::deque<int> refs_;
+  std::vector<int> refs_;
 
-  // External symbols.
+  // Positions of 32-bit pc-relative references to addresses outside the
+  // code buffer. These must be adjusted when the code is moved.
+  std::vector<int> pcrel_;
+
+  // External symbols and index of external symbols by address.
   std::vector<Extern> externs_;
+  std::unordered_map<Address, int> extern_index_;
+  bool extern_slots_ = false;
+
+  // Constant pool with the data for the constants, the labels for the
+  // constants, and an index of the constants by content. The index is an
+  // open-addressing hash table with the constant number plus one in each
+  // used slot, so it can be reused after Reset() without allocating.
+  std::string constant_data_;
+  std::vector<Constant> constants_;
+  std::deque<Label> constant_labels_;
+  std::vector<int> constant_index_;
+
+  // Shared constants referenced from the code with copies of their data,
+  // index of shared constants by address, and references to them.
+  std::string shared_data_;
+  std::vector<SharedConstant> shared_constants_;
+  std::map<Address, int> shared_index_;
+  std::vector<SharedRef> shared_refs_;
+
+  // References to labels. Unresolved references to a label are chained
+  // together through the table, starting with the last reference.
+  std::vector<Fixup> fixups_;
+
+  // Branch relaxation state. After relaxation, relax_keys_ and relax_delta_
+  // hold the original positions of the jumps and padding, and the accumulated
+  // size change after each of these.
+  bool relax_ = false;
+  bool finalized_ = false;
+  std::vector<Align> aligns_;
+  std::vector<int> relax_keys_;
+  std::vector<int> relax_delta_;
+
+  // Current section and the ranges of code emitted into each section.
+  int section_ = kHotSection;
+  std::vector<SectionRange> ranges_;
+
+  // Name of generated code, source line information, and symbols.
+  std::string name_;
+  std::vector<LineInfo> lines_;
+  std::vector<Symbol> symbols_;
+
+  // Recorded call frame changes for unwind information.
+  bool unwind_info_ = false;
+  std::vector<FrameChange> frame_ops_;
+
+  friend class ReserveSpace;
+  friend class ElfWriter;
 };
 
 // Helper class that ensures that there is enough space for generating
@@ -228,34 +660,139 @@ class EnsureSpace {
 #endif
 };
 
-// A code object holds a memory block of code that is executable.
+// Helper class that reserves space for a block of instructions. Instructions
+// emitted while the reservation is active do not check for buffer overflow,
+// so the code generator must not be finalized or flattened while space is
+// reserved. In debug mode, the destructor checks that the reservation was not
+// exceeded.
+class ReserveSpace {
+ public:
+  ReserveSpace(CodeGenerator *generator, int instructions)
+      : generator_(generator) {
+    int bytes = instructions * CodeGenerator::kMaximumInstructionSize;
+    generator_->Reserve(bytes);
+    generator_->reservations_++;
+    generator_->UpdateLimit();
+#ifdef DEBUG
+    end_ = generator_->pc_offset() + bytes;
+#endif
+  }
+
+  ~ReserveSpace() {
+    generator_->reservations_--;
+    generator_->UpdateLimit();
+#ifdef DEBUG
+    assert(generator_->pc_offset() <= end_);
+#endif
+  }
+
+ private:
+  CodeGenerator *generator_;
+#ifdef DEBUG
+  int end_;
+#endif
+};
+
+class Code;
+
+// A code observer is notified when code objects are installed and removed,
+// e.g. for registering the code with profilers and debuggers.
+class CodeObserver {
+ public:
+  virtual ~CodeObserver() = default;
+
+  // Called when code has been installed. The generator is null if the code
+  // was not produced by a code generator.
+  virtual void Installed(const Code &code,
+                         const CodeGenerator *generator) = 0;
+
+  // Called before code is removed.
+  virtual void Removed(const Code &) {}
+
+ protected:
+  // Name for code. This is the name supplied by the generator, or a name
+  // made from the code address if the generator does not supply a name.
+  static std::string CodeName(const Code &code,
+                              const CodeGenerator *generator);
+};
+
+// A code object holds a memory block of code that is executable. The memory
+// is either mapped separately for the code object or allocated from a code
+// heap, in which case the code object must not outlive the heap.
 class Code {
  public:
   // Initialize empty code object.
-  Code() : memory_(nullptr), size_(0) {}
+  Code() : memory_(nullptr), size_(0), heap_(nullptr) {}
 
   // Initialize code object from memory block. This will make a copy of the
   // code object.
   Code(void *code, int size);
+  Code(CodeHeap *heap, void *code, int size);
 
   // Initialize code object from generated code.
-  Code(CodeGenerator *generator)
-      : Code(generator->begin(), generator->size()) {}
+  Code(CodeGenerator *generator);
+  Code(CodeHeap *heap, CodeGenerator *generator);
 
   // Deallocate code block.
   ~Code();
 
   // Allocate executable memory for code object.
-  void Allocate(void *code, int size);
+  void Allocate(void *code, int size) {
+    Install(nullptr, code, size, nullptr);
+  }
   void Allocate(CodeGenerator *generator) {
-    Allocate(generator->begin(), generator->size());
+    generator->Finalize();
+    Install(nullptr, nullptr, generator->size(), generator);
+  }
+
+  // Allocate executable memory for code object in code heap. Code generated
+  // in place is committed to the heap of the code generator instead of being
+  // copied.
+  void Allocate(CodeHeap *heap, void *code, int size) {
+    Install(heap, code, size, nullptr);
+  }
+  void Allocate(CodeHeap *heap, CodeGenerator *generator) {
+    generator->Finalize();
+    Install(heap, nullptr, generator->size(), generator);
   }
 
+  // Code heap for code block or null if the code block is mapped separately.
+  CodeHeap *heap() const { return heap_; }
+
   // Memory range for code block.
   byte *begin() const { return memory_; }
   byte *end() const { return memory_ + size_; }
   int size() const { return size_; }
 
+  // Store address in the slot at the given offset in the code block. This
+  // rebinds the external symbol for the slot in code generated with extern
+  // slots. The slot is updated with a single atomic store, so running code
+  // sees either the old or the new address. Returns false if the code could
+  // not be made writable.
+  bool SetSlot(int offset, const void *address);
+
+  // Patch the aligned 32-bit or 64-bit field at the given offset in running
+  // code, e.g. the immediate of a patchable instruction. The field is updated
+  // with a single atomic store through a writable view of the code, after
+  // which all threads are serialized, so no processor keeps executing stale
+  // instructions. Threads running the code see either the old or the new
+  // value. Returns false if the code could not be made writable.
+  bool Patch32(int offset, int32_t value);
+  bool Patch64(int offset, int64_t value);
+
+  // Retarget patchable call with the rel32 displacement at the given offset.
+  // Returns false if the target cannot be reached from the call or the code
+  // could not be made writable.
+  bool PatchCall(int offset, const void *target);
+
+  // Register observer, which is notified about code installed and removed
+  // after this. Observers are called while holding a lock, so code objects
+  // are reported one at a time.
+  static void AddObserver(CodeObserver *observer);
+
+  // Unregister observer.
+  static void RemoveObserver(CodeObserver *observer);
+
   // Entry point for code block is assumed to be the beginning of the block.
   void *entry() const { return memory_; }
 
@@ -273,11 +810,31 @@ class Code {
   }
 
  private:
+  // Install code and notify the code observers.
+  void Install(CodeHeap *heap, void *code, int size,
+               CodeGenerator *generator);
+
+  // Allocate executable memory for code block, either in a code heap or in
+  // separately mapped memory, and copy the code into it. Internal references
+  // are relocated if the code was produced by a code generator.
+  void Place(CodeHeap *heap, void *code, int size, CodeGenerator *generator);
+
+  // Store value in code block atomically. The size must be 4 or 8 bytes and
+  // the location must be aligned to the size. Returns false if the code
+  // could not be made writable.
+  bool Store(int offset, uint64_t value, int size);
+
   // Memory block for code block.
   byte *memory_;
 
   // Size of code block.
   int size_;
+
+  // Code heap for code block.
+  CodeHeap *heap_;
+
+  // Unwind information registered for code block.
+  std::vector<byte> eh_frame_;
 };
 
 }  // namespace jit
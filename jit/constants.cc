@@ -0,0 +1,63 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jit/constants.h"
+
+#include <string.h>
+
+namespace sling {
+namespace jit {
+
+SharedConstantPool::~SharedConstantPool() {
+  for (auto &block : blocks_) heap_->Free(block.first, block.second);
+}
+
+Address SharedConstantPool::Add(const void *data, int size, int alignment) {
+  std::lock_guard<std::mutex> lock(mu_);
+
+  // Try to find existing constant with the same content and alignment.
+  std::string key(static_cast<const char *>(data), size);
+  key.push_back(static_cast<char>(alignment));
+  auto f = constants_.find(key);
+  if (f != constants_.end()) return f->second;
+
+  // Allocate space for constant. Heap blocks are aligned to the heap
+  // alignment, so constants can be aligned up to that.
+  // DCHECK(alignment <= CodeHeap::kAlignment);
+  Address addr = top_ + (-reinterpret_cast<uintptr_t>(top_) & (alignment - 1));
+  if (top_ == nullptr || addr + size > limit_) {
+    int bytes = size > kBlockSize ? size : kBlockSize;
+    Address block = heap_->Allocate(bytes);
+    if (block == nullptr) return nullptr;
+    heap_->Commit(block);
+    blocks_.emplace_back(block, bytes);
+    addr = block;
+    limit_ = block + bytes;
+  }
+  top_ = addr + size;
+
+  // Write constant to the heap.
+  memcpy(heap_->Reopen(addr), data, size);
+  heap_->Commit(addr);
+  constants_[key] = addr;
+  return addr;
+}
+
+Operand ConstantPool::Add(const void *data, int size, int alignment) {
+  // Code generated in place can move to another region of the heap while it
+  // is generated, so it always uses the local pool.
+  if (shared_ != nullptr && !assembler_->in_place()) {
+    Address addr = shared_->Add(data, size, alignment);
+    if (addr != nullptr) {
+      // The reach is checked when the code is installed, and the constant is
+      // copied into the code if the shared constant is out of reach.
+      assembler_->AddSharedConstant(addr, data, size, alignment);
+      return Operand(addr);
+    }
+  }
+  return Operand(assembler_->AddConstant(data, size, alignment));
+}
+
+}  // namespace jit
+}  // namespace sling
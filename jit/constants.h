@@ -0,0 +1,86 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_CONSTANTS_H_
+#define JIT_CONSTANTS_H_
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "jit/assembler.h"
+#include "jit/heap.h"
+
+namespace sling {
+namespace jit {
+
+// A shared constant pool holds read-only constants in a code heap, which can
+// be shared by all the code in the heap. Identical constants are only stored
+// once. The constants are referenced rip-relative, so code that is installed
+// out of rel32 reach of the pool gets copies of the constants instead. Using a
+// code heap with near_text placement keeps the code within reach. The shared
+// constant pool is thread-safe, and it must outlive all code using it.
+class SharedConstantPool {
+ public:
+  // Size of heap blocks for constants.
+  static const int kBlockSize = 4096;
+
+  explicit SharedConstantPool(CodeHeap *heap) : heap_(heap) {}
+  ~SharedConstantPool();
+
+  // Add constant to pool and return its address.
+  Address Add(const void *data, int size, int alignment);
+
+  // Code heap for constants.
+  CodeHeap *heap() const { return heap_; }
+
+ private:
+  // Code heap for constants.
+  CodeHeap *heap_;
+
+  // Heap blocks with constants.
+  std::vector<std::pair<Address, int>> blocks_;
+
+  // Unused space in the current block.
+  Address top_ = nullptr;
+  Address limit_ = nullptr;
+
+  // Addresses of constants indexed by their content.
+  std::unordered_map<std::string, Address> constants_;
+
+  // Mutex for serializing access to pool.
+  std::mutex mu_;
+};
+
+// A constant pool adds constants for an assembler and returns rip-relative
+// operands for the constants, which can be used by any instruction with a
+// memory operand. The constants are deduplicated and placed after the code of
+// the assembler when the code is finalized. If a shared constant pool is
+// provided, the constants are placed in the shared pool instead, except for
+// code generated in place, which can move while it is generated.
+class ConstantPool {
+ public:
+  explicit ConstantPool(Assembler *assembler,
+                        SharedConstantPool *shared = nullptr)
+      : assembler_(assembler), shared_(shared) {}
+
+  // Add constant with alignment and return operand for the constant.
+  template <typename T> Operand Add(const T &value, int alignment = sizeof(T)) {
+    return Add(&value, sizeof(T), alignment);
+  }
+  Operand Add(const void *data, int size, int alignment);
+
+ private:
+  // Assembler that uses the constants.
+  Assembler *assembler_;
+
+  // Shared constant pool or null if constants are placed after the code.
+  SharedConstantPool *shared_;
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_CONSTANTS_H_
@@ -39,11 +39,6 @@
 namespace sling {
 namespace jit {
 
-bool CPU::initialized = false;
-unsigned CPU::features = 0;
-unsigned CPU::cache_line_size = 0;
-bool CPU::vzero_needed = false;
-
 static void __cpuid(int cpu_info[4], int info_type) {
   __asm__ volatile("cpuid \n\t"
                    : "=a"(cpu_info[0]), "=b"(cpu_info[1]), "=c"(cpu_info[2]),
@@ -222,7 +217,11 @@ const char *ProcessorInformation::architecture() {
   }
 }
 
-void CPU::Initialize() {
+CpuFeatures CpuFeatures::Supported() {
+  return CpuFeatures(CPU::SupportedFeatures());
+}
+
+CPU::Info::Info() {
   ProcessorInformation cpu;
 
   if (cpu.has_mmx()) features |= 1u << MMX;
@@ -250,7 +249,6 @@ void CPU::Initialize() {
 
   cache_line_size = cpu.cache_line_size();
 
-  vzero_needed = false;
   if (cpu.has_avx()) {
 #ifndef __AVX__
     vzero_needed = true;
@@ -138,68 +138,87 @@ enum CpuFeature {
   NUMBER_OF_CPU_FEATURES,
 };
 
-// Keep track of which features are supported by the target CPU. Individual
-// features can be enabled and disabled on a global basis.
+// Set of CPU features. This is a value type, so a feature set can be copied
+// and modified without affecting the features used by other threads.
+class CpuFeatures {
+ public:
+  // Empty feature set.
+  CpuFeatures() : mask_(0) {}
+
+  // Feature set from bit mask with one bit for each feature.
+  explicit CpuFeatures(unsigned mask) : mask_(mask) {}
+
+  // Features supported by the processor.
+  static CpuFeatures Supported();
+
+  // Check if feature is in feature set.
+  bool Has(CpuFeature f) const { return (mask_ & (1u << f)) != 0; }
+
+  // Add feature to feature set.
+  void Enable(CpuFeature f) { mask_ |= (1u << f); }
+
+  // Remove feature from feature set.
+  void Disable(CpuFeature f) { mask_ &= ~(1u << f); }
+
+  // Bit mask with features.
+  unsigned mask() const { return mask_; }
+
+  bool operator==(const CpuFeatures &other) const {
+    return mask_ == other.mask_;
+  }
+  bool operator!=(const CpuFeatures &other) const {
+    return mask_ != other.mask_;
+  }
+
+ private:
+  unsigned mask_;
+};
+
+// Keep track of which features are supported by the target CPU. The CPU is
+// probed the first time the information is needed. Probing is thread-safe,
+// and after that the information is read without locking. The supported
+// features cannot be changed; use a CpuFeatures value for selecting the
+// features to use for generating code.
 class CPU {
  public:
   // Probe CPU for supported features.
-  static void Probe() {
-    if (initialized) return;
-    Initialize();
-    initialized = true;
-  }
+  static void Probe() { info(); }
 
   // Return bit mask with supported features.
-  static unsigned SupportedFeatures() {
-    Probe();
-    return features;
-  }
+  static unsigned SupportedFeatures() { return info().features; }
 
-  // Check if CPU feature is enabled.
+  // Check if CPU feature is supported.
   static bool Enabled(CpuFeature f) {
-    Probe();
-    return (features & (1u << f)) != 0;
-  }
-
-  // Enable CPU feature.
-  static void Enable(CpuFeature f) {
-    Probe();
-    features |= (1u << f);
-  }
-
-  // Disable CPU feature.
-  static void Disable(CpuFeature f) {
-    Probe();
-    features &= ~(1u << f);
+    return (info().features & (1u << f)) != 0;
   }
 
   // Cache line size.
-  static unsigned CacheLineSize() {
-    Probe();
-    return cache_line_size;
-  }
+  static unsigned CacheLineSize() { return info().cache_line_size; }
 
   // VZEROUPPER is only needed on some processors.
-  static bool VZeroNeeded() {
-    Probe();
-    return vzero_needed;
-  }
+  static bool VZeroNeeded() { return info().vzero_needed; }
 
  private:
-  // Initialize CPU features by querying the CPU.
-  static void Initialize();
+  // Information about CPU.
+  struct Info {
+    // Initialize CPU information by querying the CPU.
+    Info();
 
-  // CPU features that are enabled.
-  static unsigned features;
+    // CPU features that are supported.
+    unsigned features = 0;
 
-  // Cache line size.
-  static unsigned cache_line_size;
+    // Cache line size.
+    unsigned cache_line_size = 0;
 
-  // VZEROUPPER needed on AVX/SSE transitions.
-  static bool vzero_needed;
+    // VZEROUPPER needed on AVX/SSE transitions.
+    bool vzero_needed = false;
+  };
 
-  // CPU features are only probed once.
-  static bool initialized;
+  // Return CPU information. The CPU is only probed once.
+  static const Info &info() {
+    static const Info cpu_info;
+    return cpu_info;
+  }
 };
 
 }  // namespace jit
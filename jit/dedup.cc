@@ -0,0 +1,132 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jit/dedup.h"
+
+#include <string.h>
+#include <functional>
+
+namespace sling {
+namespace jit {
+
+// Append value to content.
+template <class T> static void Put(std::string *content, const T &value) {
+  content->append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+static void Put(std::string *content, const std::vector<int> &positions) {
+  Put(content, positions.size());
+  content->append(reinterpret_cast<const char *>(positions.data()),
+                  positions.size() * sizeof(int));
+}
+
+std::string CodeDeduplicator::Content(CodeGenerator *generator) {
+  // Copy the code relocated to address zero, so internal references hold
+  // offsets in the code and pc-relative references to external addresses
+  // are relative to the start of the code.
+  generator->Finalize();
+  int size = generator->size();
+  std::string content(size, 0);
+  byte *data = reinterpret_cast<byte *>(&content[0]);
+  generator->CopyTo(data, nullptr);
+
+  // Calls to external symbols that do not go through a veneer cannot be
+  // relocated to address zero, so their displacements depend on where the
+  // code was generated. These are cleared, since the call targets are part
+  // of the extern bindings.
+  for (const Extern &e : generator->externs()) {
+    for (int pos : e.calls) memset(data + pos, 0, sizeof(int32_t));
+  }
+
+  // Add the bindings of the external symbols, since the code only holds the
+  // addresses of the symbols.
+  for (const Extern &e : generator->externs()) {
+    Put(&content, e.address);
+    Put(&content, e.refs);
+    Put(&content, e.calls);
+    Put(&content, e.slot);
+    Put(&content, e.veneer);
+  }
+  Put(&content, size);
+  return content;
+}
+
+std::shared_ptr<Code> CodeDeduplicator::Find(Shard *shard, size_t hash,
+                                             const std::string &content) {
+  auto f = shard->entries.find(hash);
+  if (f == shard->entries.end()) return nullptr;
+  for (Entry &entry : f->second) {
+    if (entry.content != content) continue;
+    std::shared_ptr<Code> code = entry.code.lock();
+    if (code != nullptr) return code;
+  }
+  return nullptr;
+}
+
+std::shared_ptr<Code> CodeDeduplicator::Install(CodeGenerator *generator) {
+  std::string content = Content(generator);
+  size_t hash = std::hash<std::string>()(content);
+  Shard *shard = &shards_[hash % kNumShards];
+
+  // Return existing code with the same content.
+  {
+    std::lock_guard<std::mutex> lock(shard->mu);
+    std::shared_ptr<Code> code = Find(shard, hash, content);
+    if (code != nullptr) {
+      hits_++;
+      return code;
+    }
+  }
+
+  // Install code without holding the lock. The code is removed from the
+  // cache when the last reference to it is released.
+  Code *installed = new Code(heap_, generator);
+  std::shared_ptr<Code> code(installed, [this, shard, hash](Code *code) {
+    Release(shard, hash, code);
+  });
+
+  // Another thread might have installed the same code in the meantime, in
+  // which case the new code is dropped.
+  std::lock_guard<std::mutex> lock(shard->mu);
+  std::shared_ptr<Code> existing = Find(shard, hash, content);
+  if (existing != nullptr) {
+    hits_++;
+    return existing;
+  }
+  shard->entries[hash].push_back({std::move(content), code});
+  return code;
+}
+
+void CodeDeduplicator::Release(Shard *shard, size_t hash, Code *code) {
+  {
+    // Remove the entries for freed code. Entries for code with the same
+    // content installed after this code was released are kept.
+    std::lock_guard<std::mutex> lock(shard->mu);
+    auto f = shard->entries.find(hash);
+    if (f != shard->entries.end()) {
+      std::vector<Entry> &entries = f->second;
+      size_t kept = 0;
+      for (size_t i = 0; i < entries.size(); ++i) {
+        if (entries[i].code.expired()) continue;
+        if (kept != i) entries[kept] = std::move(entries[i]);
+        kept++;
+      }
+      entries.resize(kept);
+      if (entries.empty()) shard->entries.erase(f);
+    }
+  }
+  delete code;
+}
+
+int CodeDeduplicator::size() {
+  int size = 0;
+  for (Shard &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mu);
+    for (auto &it : shard.entries) size += it.second.size();
+  }
+  return size;
+}
+
+}  // namespace jit
+}  // namespace sling
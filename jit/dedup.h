@@ -0,0 +1,88 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_DEDUP_H_
+#define JIT_DEDUP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "jit/code.h"
+#include "jit/heap.h"
+
+namespace sling {
+namespace jit {
+
+// Content-addressed cache for sharing identical code. Code is identified by
+// its finalized bytes, independent of where it was generated, together with
+// the bindings of its external symbols. When code identical to code that is
+// already installed is added, the installed code is returned instead of
+// installing another copy. The code is handed out as shared code objects,
+// which are removed from the cache and freed when the last reference is
+// released. The cache must outlive the code objects it hands out.
+//
+// The cache is split into shards by content hash, each with its own lock, so
+// compile threads adding code at the same time rarely contend. Code is
+// installed outside the lock.
+class CodeDeduplicator {
+ public:
+  // Initialize cache for code installed in a code heap, or in separately
+  // mapped memory if no heap is given.
+  explicit CodeDeduplicator(CodeHeap *heap = nullptr) : heap_(heap) {}
+
+  // Finalize code generator and return shared code with its content. The
+  // code is installed unless identical code is already installed.
+  std::shared_ptr<Code> Install(CodeGenerator *generator);
+
+  // Number of code objects in the cache.
+  int size();
+
+  // Number of times installed code was reused.
+  int64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+
+ private:
+  // Installed code with its content.
+  struct Entry {
+    std::string content;
+    std::weak_ptr<Code> code;
+  };
+
+  // Shard with entries by content hash.
+  struct Shard {
+    std::mutex mu;
+    std::unordered_map<size_t, std::vector<Entry>> entries;
+  };
+
+  // Return position-independent content for code generator.
+  static std::string Content(CodeGenerator *generator);
+
+  // Find live code with content in shard. The shard must be locked.
+  static std::shared_ptr<Code> Find(Shard *shard, size_t hash,
+                                    const std::string &content);
+
+  // Remove entries for freed code with hash from shard and free the code.
+  void Release(Shard *shard, size_t hash, Code *code);
+
+  static const int kNumShards = 16;
+
+  // Code heap for installing code.
+  CodeHeap *heap_;
+
+  // Shards with the cached code.
+  Shard shards_[kNumShards];
+
+  // Number of times installed code was reused.
+  std::atomic<int64_t> hits_{0};
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_DEDUP_H_
@@ -0,0 +1,76 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdio.h>
+
+#include "jit/assembler.h"
+#include "jit/dedup.h"
+#include "jit/heap.h"
+
+using namespace sling::jit;
+
+extern "C" int64_t Increment(int64_t x) { return x + 1; }
+
+// Generate kernel returning value + 1 through an external call.
+static void Generate(Assembler *masm, int32_t value) {
+  masm->movq(rdi, Immediate(value));
+  masm->subq(rsp, Immediate(8));
+  masm->call_extern(reinterpret_cast<void *>(&Increment), "Increment");
+  masm->addq(rsp, Immediate(8));
+  masm->ret(0);
+}
+
+static int64_t Run(const Code &code) {
+  return reinterpret_cast<int64_t (*)()>(code.entry())();
+}
+
+int main() {
+  // Code generated in place in a heap near the program text calls external
+  // functions directly, so the call displacements depend on where the code
+  // was generated.
+  CodeHeap::Options options;
+  options.near_text = true;
+  CodeHeap heap(options);
+  CodeDeduplicator dedup(&heap);
+
+  Assembler a(&heap);
+  Assembler b(&heap);
+  Assembler c(&heap);
+  Generate(&a, 5);
+  Generate(&b, 5);
+  Generate(&c, 6);
+  std::shared_ptr<Code> ca = dedup.Install(&a);
+  std::shared_ptr<Code> cb = dedup.Install(&b);
+  std::shared_ptr<Code> cc = dedup.Install(&c);
+
+  if (ca != cb) {
+    fprintf(stderr, "identical in-place code not shared\n");
+    return 1;
+  }
+  if (ca == cc) {
+    fprintf(stderr, "different code shared\n");
+    return 1;
+  }
+  if (Run(*ca) != 6 || Run(*cc) != 7) {
+    fprintf(stderr, "wrong result from shared code\n");
+    return 1;
+  }
+  if (dedup.size() != 2 || dedup.hits() != 1) {
+    fprintf(stderr, "unexpected cache size %d or hits %ld\n", dedup.size(),
+            static_cast<long>(dedup.hits()));
+    return 1;
+  }
+
+  // Code is removed from the cache when the last reference is released.
+  ca.reset();
+  cb.reset();
+  cc.reset();
+  if (dedup.size() != 0) {
+    fprintf(stderr, "released code still in cache\n");
+    return 1;
+  }
+
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,404 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jit/elf.h"
+
+#include <elf.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+namespace sling {
+namespace jit {
+
+// Pad data to alignment.
+static uint64_t Align(std::string *data, int alignment, char fill) {
+  while (data->size() % alignment != 0) data->push_back(fill);
+  return data->size();
+}
+
+// Append table to data.
+template <class T> static uint64_t Append(std::string *data,
+                                          const std::vector<T> &table) {
+  uint64_t offset = Align(data, 8, 0);
+  data->append(reinterpret_cast<const char *>(table.data()),
+               table.size() * sizeof(T));
+  return offset;
+}
+
+// Size of veneer for calls to external symbols (jmp [rip+0]; dq address).
+static const int kVeneerSize = 6 + sizeof(Address);
+
+std::string *ElfWriter::Section(int section) {
+  switch (section) {
+    case kRodata: return &rodata_;
+    case kData: return &data_;
+    default: return &text_;
+  }
+}
+
+bool ElfWriter::Add(CodeGenerator *generator) {
+  if (generator->name().empty()) return false;
+  generator->Finalize();
+
+  // Pc-relative references to addresses outside the code can only be
+  // relocated if the address is an external symbol.
+  if (!generator->pcrel_.empty()) return false;
+
+  // Find the constant pool, which is placed after the code, and is followed
+  // by the extern slots and veneers.
+  int size = generator->pc_offset();
+  int begin = size;
+  int end = 0;
+  int alignment = 1;
+  for (size_t i = 0; i < generator->constants_.size(); ++i) {
+    const CodeGenerator::Constant &c = generator->constants_[i];
+    int pos = generator->constant_labels_[i].pos();
+    begin = std::min(begin, pos);
+    end = std::max(end, pos + c.size);
+    alignment = std::max(alignment, c.alignment);
+  }
+  std::vector<Range> ranges;
+  if (begin < end) ranges.push_back({begin, end, kRodata, 0});
+
+  // Absolute addresses stored as data, i.e. the extern slots and the label
+  // addresses in refs_, are moved to the .data.rel.ro section. Adjacent
+  // addresses are kept together, so tables of addresses stay intact.
+  std::vector<int> data = generator->refs_;
+  for (const Extern &e : generator->externs_) {
+    if (e.slot != -1) data.push_back(e.slot);
+  }
+  std::sort(data.begin(), data.end());
+  for (int pos : data) {
+    Range *last = ranges.empty() ? nullptr : &ranges.back();
+    if (last != nullptr && last->section == kData && last->end == pos) {
+      last->end += sizeof(int64_t);
+    } else {
+      ranges.push_back({pos, pos + static_cast<int>(sizeof(int64_t)), kData,
+                        0});
+    }
+  }
+
+  // Calls to external symbols are relocated to call the symbols directly,
+  // so the veneers are left out.
+  for (const Extern &e : generator->externs_) {
+    if (e.veneer != -1) {
+      ranges.push_back({e.veneer, e.veneer + kVeneerSize, kNone, 0});
+    }
+  }
+  std::sort(ranges.begin(), ranges.end(),
+            [](const Range &a, const Range &b) { return a.begin < b.begin; });
+
+  // Copy the ranges of the code to the sections. The rest of the code goes
+  // to the .text section.
+  std::string code(size, 0);
+  generator->CopyTo(reinterpret_cast<byte *>(&code[0]), generator->origin_);
+  uint64_t text = Align(&text_, 16, 0xCC);
+  Align(&rodata_, alignment, 0);
+  rodata_alignment_ = std::max(rodata_alignment_, alignment);
+  std::vector<Range> layout;
+  auto place = [&](int begin, int end, int section) {
+    uint64_t at = 0;
+    if (section != kNone) {
+      std::string *contents = Section(section);
+      if (section == kData) Align(contents, sizeof(int64_t), 0);
+      at = contents->size();
+      contents->append(code, begin, end - begin);
+    }
+    layout.push_back({begin, end, section, at});
+  };
+  int pos = 0;
+  for (const Range &r : ranges) {
+    if (pos < r.begin) place(pos, r.begin, kText);
+    place(r.begin, r.end, r.section);
+    pos = r.end;
+  }
+  if (pos < size) place(pos, size, kText);
+
+  // Map position in code to section offset. The end of the code maps to the
+  // end of the .text section.
+  auto offset = [&](int pos, int *section) -> uint64_t {
+    auto r = std::upper_bound(layout.begin(), layout.end(), pos,
+        [](int pos, const Range &r) { return pos < r.end; });
+    if (r == layout.end()) {
+      *section = kText;
+      return text_.size();
+    }
+    *section = r->section;
+    return r->offset + pos - r->begin;
+  };
+
+  // Add relocation for the field at the position in the code. References
+  // from code that is left out are dropped.
+  auto relocate = [&](int pos, int target, int type, int64_t addend) {
+    int section;
+    uint64_t at = offset(pos, &section);
+    if (section == kNone) return;
+    relocations_.push_back({section, at, target, type, addend});
+    int bytes = type == R_X86_64_64 ? sizeof(int64_t) : sizeof(int32_t);
+    memset(&(*Section(section))[at], 0, bytes);
+  };
+
+  // References to labels. Pc-relative references are patched for the new
+  // layout, or relocated if the label was moved to another section.
+  for (const CodeGenerator::Fixup &f : generator->fixups_) {
+    if (f.target < 0 || f.kind == CodeGenerator::kAbs64) continue;
+    int section;
+    int target;
+    uint64_t at = offset(f.pos, &section);
+    uint64_t address = offset(f.target, &target);
+    if (section == kNone) continue;
+    char *field = &(*Section(section))[at];
+    int32_t value;
+    if (f.kind == CodeGenerator::kJump8) {
+      *field = address - (at + sizeof(int8_t));
+      continue;
+    } else if (f.kind == CodeGenerator::kOffset32) {
+      int base;
+      value = address - offset(f.arg, &base);
+    } else if (target != section) {
+      relocate(f.pos, target, R_X86_64_PC32,
+               address - (sizeof(int32_t) + f.arg));
+      continue;
+    } else {
+      value = address - (at + sizeof(int32_t) + f.arg);
+    }
+    memcpy(field, &value, sizeof(int32_t));
+  }
+
+  // Absolute references to labels.
+  for (int pos : generator->refs_) {
+    int64_t value = *reinterpret_cast<int64_t *>(&code[pos]);
+    int label = value - reinterpret_cast<int64_t>(generator->origin_);
+    int target;
+    uint64_t address = offset(label, &target);
+    relocate(pos, target, R_X86_64_64, address);
+  }
+
+  // References to external symbols.
+  for (const Extern &e : generator->externs_) {
+    auto f = extern_index_.find(e.symbol);
+    int index;
+    if (f != extern_index_.end()) {
+      index = f->second;
+    } else {
+      index = externs_.size();
+      externs_.push_back(e.symbol);
+      extern_index_[e.symbol] = index;
+    }
+    for (int pos : e.refs) relocate(pos, index, R_X86_64_64, 0);
+    for (int pos : e.calls) relocate(pos, index, R_X86_64_PLT32, -4);
+
+    // The slots are in the .data.rel.ro section.
+    if (e.slot != -1) {
+      int target;
+      uint64_t slot = offset(e.slot, &target);
+      for (int pos : e.slot_refs) {
+        relocate(pos, target, R_X86_64_PC32, slot - sizeof(int32_t));
+      }
+    }
+  }
+
+  // Define symbols for the code and the symbols added to the code generator.
+  functions_.push_back({generator->name(), text, text_.size() - text});
+  for (const CodeGenerator::Symbol &symbol : generator->symbols()) {
+    int first = generator->Translate(symbol.begin);
+    int last = generator->Translate(symbol.end);
+    int section;
+    uint64_t start = offset(first, &section);
+    uint64_t length = 0;
+    if (last > first) length = offset(last - 1, &section) + 1 - start;
+    functions_.push_back({symbol.name, start, length});
+  }
+  return true;
+}
+
+std::string ElfWriter::Build() const {
+  enum {
+    kNullSection,
+    kTextSection,
+    kRodataSection,
+    kDataSection,
+    kRelaTextSection,
+    kRelaDataSection,
+    kSymtabSection,
+    kStrtabSection,
+    kShstrtabSection,
+    kStackSection,
+    kNumSections,
+  };
+
+  // Section names.
+  static const char *kSectionNames[kNumSections] = {
+    "", ".text", ".rodata", ".data.rel.ro", ".rela.text", ".rela.data.rel.ro",
+    ".symtab", ".strtab", ".shstrtab", ".note.GNU-stack",
+  };
+  std::string shstrtab;
+  int names[kNumSections];
+  for (int i = 0; i < kNumSections; ++i) {
+    names[i] = shstrtab.size();
+    shstrtab.append(kSectionNames[i], strlen(kSectionNames[i]) + 1);
+  }
+
+  // Symbol table with the section symbols, followed by the global function
+  // symbols and the undefined external symbols.
+  std::string strtab(1, 0);
+  std::vector<Elf64_Sym> symtab;
+  auto add = [&](const std::string &name, int info, int section,
+                 uint64_t value, uint64_t size) {
+    Elf64_Sym sym;
+    sym.st_name = 0;
+    if (!name.empty()) {
+      sym.st_name = strtab.size();
+      strtab.append(name.c_str(), name.size() + 1);
+    }
+    sym.st_info = info;
+    sym.st_other = STV_DEFAULT;
+    sym.st_shndx = section;
+    sym.st_value = value;
+    sym.st_size = size;
+    symtab.push_back(sym);
+  };
+  add("", 0, SHN_UNDEF, 0, 0);
+  add("", ELF64_ST_INFO(STB_LOCAL, STT_SECTION), kTextSection, 0, 0);
+  add("", ELF64_ST_INFO(STB_LOCAL, STT_SECTION), kRodataSection, 0, 0);
+  add("", ELF64_ST_INFO(STB_LOCAL, STT_SECTION), kDataSection, 0, 0);
+  int num_locals = symtab.size();
+  for (const Function &f : functions_) {
+    add(f.name, ELF64_ST_INFO(STB_GLOBAL, STT_FUNC), kTextSection, f.offset,
+        f.size);
+  }
+  int first_extern = symtab.size();
+  for (const std::string &name : externs_) {
+    add(name, ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE), SHN_UNDEF, 0, 0);
+  }
+
+  // Relocations for the .text and .data.rel.ro sections. The section symbols
+  // have the same indices as the sections.
+  std::vector<Elf64_Rela> rela_text;
+  std::vector<Elf64_Rela> rela_data;
+  for (const Relocation &r : relocations_) {
+    int symbol;
+    switch (r.target) {
+      case kText: symbol = kTextSection; break;
+      case kRodata: symbol = kRodataSection; break;
+      case kData: symbol = kDataSection; break;
+      default: symbol = first_extern + r.target;
+    }
+    Elf64_Rela entry;
+    entry.r_offset = r.offset;
+    entry.r_info = ELF64_R_INFO(symbol, r.type);
+    entry.r_addend = r.addend;
+    if (r.section == kData) {
+      rela_data.push_back(entry);
+    } else {
+      rela_text.push_back(entry);
+    }
+  }
+
+  // Lay out the sections after the file header.
+  std::string file(sizeof(Elf64_Ehdr), 0);
+  Elf64_Shdr shdr[kNumSections];
+  memset(shdr, 0, sizeof(shdr));
+  for (int i = 0; i < kNumSections; ++i) shdr[i].sh_name = names[i];
+
+  shdr[kTextSection].sh_type = SHT_PROGBITS;
+  shdr[kTextSection].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  shdr[kTextSection].sh_offset = Align(&file, 16, 0);
+  shdr[kTextSection].sh_size = text_.size();
+  shdr[kTextSection].sh_addralign = 16;
+  file.append(text_);
+
+  shdr[kRodataSection].sh_type = SHT_PROGBITS;
+  shdr[kRodataSection].sh_flags = SHF_ALLOC;
+  shdr[kRodataSection].sh_offset = Align(&file, rodata_alignment_, 0);
+  shdr[kRodataSection].sh_size = rodata_.size();
+  shdr[kRodataSection].sh_addralign = rodata_alignment_;
+  file.append(rodata_);
+
+  shdr[kDataSection].sh_type = SHT_PROGBITS;
+  shdr[kDataSection].sh_flags = SHF_ALLOC | SHF_WRITE;
+  shdr[kDataSection].sh_offset = Align(&file, 8, 0);
+  shdr[kDataSection].sh_size = data_.size();
+  shdr[kDataSection].sh_addralign = 8;
+  file.append(data_);
+
+  shdr[kRelaTextSection].sh_type = SHT_RELA;
+  shdr[kRelaTextSection].sh_flags = SHF_INFO_LINK;
+  shdr[kRelaTextSection].sh_offset = Append(&file, rela_text);
+  shdr[kRelaTextSection].sh_size = rela_text.size() * sizeof(Elf64_Rela);
+  shdr[kRelaTextSection].sh_link = kSymtabSection;
+  shdr[kRelaTextSection].sh_info = kTextSection;
+  shdr[kRelaTextSection].sh_addralign = 8;
+  shdr[kRelaTextSection].sh_entsize = sizeof(Elf64_Rela);
+
+  shdr[kRelaDataSection].sh_type = SHT_RELA;
+  shdr[kRelaDataSection].sh_flags = SHF_INFO_LINK;
+  shdr[kRelaDataSection].sh_offset = Append(&file, rela_data);
+  shdr[kRelaDataSection].sh_size = rela_data.size() * sizeof(Elf64_Rela);
+  shdr[kRelaDataSection].sh_link = kSymtabSection;
+  shdr[kRelaDataSection].sh_info = kDataSection;
+  shdr[kRelaDataSection].sh_addralign = 8;
+  shdr[kRelaDataSection].sh_entsize = sizeof(Elf64_Rela);
+
+  shdr[kSymtabSection].sh_type = SHT_SYMTAB;
+  shdr[kSymtabSection].sh_offset = Append(&file, symtab);
+  shdr[kSymtabSection].sh_size = symtab.size() * sizeof(Elf64_Sym);
+  shdr[kSymtabSection].sh_link = kStrtabSection;
+  shdr[kSymtabSection].sh_info = num_locals;
+  shdr[kSymtabSection].sh_addralign = 8;
+  shdr[kSymtabSection].sh_entsize = sizeof(Elf64_Sym);
+
+  shdr[kStrtabSection].sh_type = SHT_STRTAB;
+  shdr[kStrtabSection].sh_offset = file.size();
+  shdr[kStrtabSection].sh_size = strtab.size();
+  shdr[kStrtabSection].sh_addralign = 1;
+  file.append(strtab);
+
+  shdr[kShstrtabSection].sh_type = SHT_STRTAB;
+  shdr[kShstrtabSection].sh_offset = file.size();
+  shdr[kShstrtabSection].sh_size = shstrtab.size();
+  shdr[kShstrtabSection].sh_addralign = 1;
+  file.append(shstrtab);
+
+  // Empty .note.GNU-stack section to mark that the code does not need an
+  // executable stack.
+  shdr[kStackSection].sh_type = SHT_PROGBITS;
+  shdr[kStackSection].sh_offset = file.size();
+  shdr[kStackSection].sh_addralign = 1;
+
+  // Section headers.
+  uint64_t shoff = Align(&file, 8, 0);
+  file.append(reinterpret_cast<const char *>(shdr), sizeof(shdr));
+
+  // File header.
+  Elf64_Ehdr *ehdr = reinterpret_cast<Elf64_Ehdr *>(&file[0]);
+  memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+  ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  ehdr->e_type = ET_REL;
+  ehdr->e_machine = EM_X86_64;
+  ehdr->e_version = EV_CURRENT;
+  ehdr->e_shoff = shoff;
+  ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr->e_shentsize = sizeof(Elf64_Shdr);
+  ehdr->e_shnum = kNumSections;
+  ehdr->e_shstrndx = kShstrtabSection;
+
+  return file;
+}
+
+bool ElfWriter::Write(const std::string &filename) const {
+  std::string file = Build();
+  FILE *f = fopen(filename.c_str(), "w");
+  if (f == nullptr) return false;
+  bool ok = fwrite(file.data(), 1, file.size(), f) == file.size();
+  if (fclose(f) != 0) ok = false;
+  return ok;
+}
+
+}  // namespace jit
+}  // namespace sling
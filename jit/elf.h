@@ -0,0 +1,108 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_ELF_H_
+#define JIT_ELF_H_
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "jit/code.h"
+
+namespace sling {
+namespace jit {
+
+// Writer for ELF64 relocatable object files with generated code, e.g. for
+// generating code ahead of time and linking it into a binary. The code from
+// all the code generators is placed in the .text section, and the constant
+// pools are placed in the .rodata section. Absolute addresses stored as data,
+// i.e. extern slots and addresses of labels added with dq(), are placed in
+// the writable .data.rel.ro section, so they can be relocated without
+// relocating the .text section. Each code generator is defined as a global
+// function symbol with the name of the code generator, and the symbols added
+// to the code generator are defined as global function symbols as well.
+// References to external symbols become relocations against undefined
+// symbols, and absolute references to labels become relocations against the
+// sections. Calls to external symbols are relocated to call the symbol
+// directly, so no veneers are written.
+//
+// Addresses that are not external symbols, e.g. immediate pointers, are
+// written to the object file as is, so code for object files must refer to
+// everything outside the code through external symbols. External addresses
+// loaded as immediates are relocated in the .text section, so code for
+// position-independent executables should use extern slots to avoid text
+// relocations.
+class ElfWriter {
+ public:
+  // Finalize code generator and add its code to the object file. Returns
+  // false if the code cannot be written to an object file, i.e. if the code
+  // generator has no name or the code has pc-relative references to addresses
+  // outside the code that are not external symbols.
+  bool Add(CodeGenerator *generator);
+
+  // Return object file with the code added.
+  std::string Build() const;
+
+  // Write object file. Returns false if the file could not be written.
+  bool Write(const std::string &filename) const;
+
+ private:
+  // Relocation targets other than external symbols.
+  enum Target {
+    kText = -1,    // .text section
+    kRodata = -2,  // .rodata section
+    kData = -3,    // .data.rel.ro section
+    kNone = -4,    // code that is not written to the object file
+  };
+
+  // Range of code placed in a section.
+  struct Range {
+    int begin;        // start position in code
+    int end;          // end position in code
+    int section;      // section Target for the range
+    uint64_t offset;  // offset of range in section
+  };
+
+  // Relocation in the .text or .data.rel.ro section.
+  struct Relocation {
+    int section;      // section Target for the relocation
+    uint64_t offset;  // offset in section
+    int target;       // Target or index of external symbol
+    int type;         // relocation type
+    int64_t addend;   // relocation addend
+  };
+
+  // Return contents of section.
+  std::string *Section(int section);
+
+  // Function defined in the .text section.
+  struct Function {
+    std::string name;  // symbol name
+    uint64_t offset;   // offset in .text section
+    uint64_t size;     // size of function
+  };
+
+  // Section contents.
+  std::string text_;
+  std::string rodata_;
+  std::string data_;
+  int rodata_alignment_ = 1;
+
+  // Relocations for the .text and .data.rel.ro sections.
+  std::vector<Relocation> relocations_;
+
+  // Defined functions.
+  std::vector<Function> functions_;
+
+  // External symbols and index of external symbols by name.
+  std::vector<std::string> externs_;
+  std::unordered_map<std::string, int> extern_index_;
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_ELF_H_
@@ -0,0 +1,101 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jit/epoch.h"
+
+namespace sling {
+namespace jit {
+
+thread_local EpochManager::Cache EpochManager::cache;
+
+// Epoch manager ids are never reused, so a thread can not mistake the record
+// for a deleted epoch manager for a record in a new one.
+static std::atomic<uint64_t> next_manager_id{1};
+
+EpochManager::EpochManager() : id_(next_manager_id++) {}
+
+EpochManager::~EpochManager() {
+  for (Retired &r : retired_) delete r.code;
+  Record *r = records_.load(std::memory_order_acquire);
+  while (r != nullptr) {
+    Record *next = r->next;
+    delete r;
+    r = next;
+  }
+}
+
+EpochManager::Record *EpochManager::Register() {
+  // Find existing record for thread.
+  std::thread::id self = std::this_thread::get_id();
+  Record *r = records_.load(std::memory_order_acquire);
+  while (r != nullptr && r->owner != self) r = r->next;
+
+  // Add new record for thread.
+  if (r == nullptr) {
+    r = new Record();
+    r->owner = self;
+    r->next = records_.load(std::memory_order_relaxed);
+    while (!records_.compare_exchange_weak(r->next, r,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {}
+  }
+
+  cache.manager = id_;
+  cache.record = r;
+  return r;
+}
+
+void EpochManager::Retire(Code *code) {
+  std::lock_guard<std::mutex> lock(mu_);
+  retired_.push_back({code, epoch_.load(std::memory_order_relaxed)});
+  if (retired_.size() >= kReclaimThreshold) {
+    Advance();
+    Free();
+  }
+}
+
+void EpochManager::Reclaim() {
+  std::lock_guard<std::mutex> lock(mu_);
+  Advance();
+  Free();
+}
+
+int EpochManager::retired() {
+  std::lock_guard<std::mutex> lock(mu_);
+  return retired_.size();
+}
+
+void EpochManager::Advance() {
+  // The epoch can only be advanced when no thread is still in the previous
+  // epoch.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+  uint64_t current = (epoch << 1) | 1;
+  Record *r = records_.load(std::memory_order_acquire);
+  while (r != nullptr) {
+    uint64_t state = r->state.load(std::memory_order_acquire);
+    if (state != 0 && state != current) return;
+    r = r->next;
+  }
+  epoch_.store(epoch + 1, std::memory_order_release);
+}
+
+void EpochManager::Free() {
+  // Code retired in an epoch can be freed when the global epoch has advanced
+  // twice, since all threads have then left the epoch in which the code was
+  // retired.
+  uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+  int kept = 0;
+  for (Retired &r : retired_) {
+    if (r.epoch + 2 <= epoch) {
+      delete r.code;
+    } else {
+      retired_[kept++] = r;
+    }
+  }
+  retired_.resize(kept);
+}
+
+}  // namespace jit
+}  // namespace sling
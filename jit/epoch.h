@@ -0,0 +1,143 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_EPOCH_H_
+#define JIT_EPOCH_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "jit/code.h"
+
+namespace sling {
+namespace jit {
+
+// An epoch manager reclaims retired code once no thread can still be
+// executing it. Threads calling into generated code that can be retired
+// enter the epoch manager before the call and exit it afterwards, e.g. with
+// an EpochGuard. Entering and exiting only update a record owned by the
+// calling thread, so the calls into generated code never take locks.
+//
+// Code that has been replaced, e.g. by swapping an entry slot, is retired in
+// the current global epoch. The global epoch is advanced when all threads in
+// the epoch manager have entered the current epoch, and code retired in an
+// epoch is freed when the global epoch has advanced twice since then. At
+// that point, all threads that could have picked up the old code have left
+// the epoch manager.
+class EpochManager {
+ public:
+  // Number of retired code objects that triggers reclamation.
+  static const int kReclaimThreshold = 16;
+
+  EpochManager();
+
+  // Free all retired code. No threads may be in the epoch manager.
+  ~EpochManager();
+
+  // Enter epoch manager on the calling thread. Calls can be nested.
+  void Enter() {
+    Record *r = record();
+    if (r->nesting++ == 0) {
+      uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+      r->state.store((epoch << 1) | 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+
+  // Exit epoch manager on the calling thread.
+  void Exit() {
+    Record *r = record();
+    if (--r->nesting == 0) r->state.store(0, std::memory_order_release);
+  }
+
+  // Retire code. The code is freed when no thread can be executing it
+  // anymore. This never waits for other threads.
+  void Retire(Code *code);
+
+  // Try to advance the global epoch and free the retired code that is no
+  // longer in use. This never waits for other threads.
+  void Reclaim();
+
+  // Current global epoch.
+  uint64_t epoch() const { return epoch_.load(std::memory_order_relaxed); }
+
+  // Number of retired code objects that have not been freed yet.
+  int retired();
+
+ private:
+  // Epoch state for a thread. The state is zero when the thread is not in
+  // the epoch manager; otherwise it is the epoch entered by the thread
+  // shifted one bit left with the low bit set.
+  struct Record {
+    std::atomic<uint64_t> state{0};
+    int nesting = 0;
+    std::thread::id owner;
+    Record *next = nullptr;
+  };
+
+  // Retired code.
+  struct Retired {
+    Code *code;       // code to be freed
+    uint64_t epoch;   // global epoch when code was retired
+  };
+
+  // Return record for calling thread.
+  Record *record() {
+    if (cache.manager == id_) return cache.record;
+    return Register();
+  }
+
+  // Find or add record for calling thread.
+  Record *Register();
+
+  // Advance global epoch if all threads in the epoch manager have entered the
+  // current epoch.
+  void Advance();
+
+  // Free retired code that can no longer be in use.
+  void Free();
+
+  // Record for the last epoch manager used by the thread.
+  struct Cache {
+    uint64_t manager = 0;
+    Record *record = nullptr;
+  };
+  static thread_local Cache cache;
+
+  // Unique id for epoch manager.
+  uint64_t id_;
+
+  // Global epoch.
+  std::atomic<uint64_t> epoch_{1};
+
+  // Thread records. Records are only added, and they are deleted with the
+  // epoch manager.
+  std::atomic<Record *> records_{nullptr};
+
+  // Retired code waiting to be freed.
+  std::vector<Retired> retired_;
+
+  // Mutex for serializing reclamation.
+  std::mutex mu_;
+};
+
+// Enter epoch manager for the lifetime of the guard.
+class EpochGuard {
+ public:
+  explicit EpochGuard(EpochManager *epochs) : epochs_(epochs) {
+    epochs_->Enter();
+  }
+  ~EpochGuard() { epochs_->Exit(); }
+
+ private:
+  EpochManager *epochs_;
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_EPOCH_H_
@@ -0,0 +1,285 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jit/gdbjit.h"
+
+#include <elf.h>
+#include <string.h>
+
+// GDB JIT interface. GDB looks up these symbols by name, so they must have C
+// linkage. They are weak so other JIT compilers in the same process can supply
+// the same definitions.
+extern "C" {
+
+enum JitAction {
+  JIT_NOACTION = 0,
+  JIT_REGISTER_FN,
+  JIT_UNREGISTER_FN,
+};
+
+struct jit_code_entry {
+  jit_code_entry *next_entry;
+  jit_code_entry *prev_entry;
+  const char *symfile_addr;
+  uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+  uint32_t version;
+  uint32_t action_flag;
+  jit_code_entry *relevant_entry;
+  jit_code_entry *first_entry;
+};
+
+// GDB sets a breakpoint on this function to get notified about changes to
+// the descriptor.
+void __attribute__((weak, noinline)) __jit_debug_register_code() {
+  __asm__ __volatile__("");
+}
+
+jit_descriptor __attribute__((weak)) __jit_debug_descriptor = {
+  1, JIT_NOACTION, nullptr, nullptr
+};
+
+}  // extern "C"
+
+namespace sling {
+namespace jit {
+
+// The descriptor is shared by all observers in the process.
+static std::mutex descriptor_mu;
+
+// Registered symbol file.
+struct GdbJitInterface::Entry {
+  jit_code_entry entry;             // entry in GDB descriptor list
+  std::string symfile;              // ELF symbol file
+  std::vector<Function> functions;  // code objects in symbol file
+};
+
+GdbJitInterface::GdbJitInterface(int batch_size) : batch_size_(batch_size) {}
+
+GdbJitInterface::~GdbJitInterface() {
+  std::lock_guard<std::mutex> lock(mu_);
+  std::vector<Entry *> entries;
+  for (auto &it : entries_) {
+    if (it.second->functions[0].code == it.first) entries.push_back(it.second);
+  }
+  for (Entry *entry : entries) Unregister(entry, nullptr);
+}
+
+void GdbJitInterface::Installed(const Code &code,
+                                const CodeGenerator *generator) {
+  // Symbol positions are translated to the final code now, since the
+  // generator might be reused before the code is registered.
+  Function function;
+  function.code = &code;
+  if (generator != nullptr && !generator->symbols().empty()) {
+    for (const auto &symbol : generator->symbols()) {
+      int begin = generator->Translate(symbol.begin);
+      int end = generator->Translate(symbol.end);
+      function.symbols.push_back({symbol.name, begin, end});
+    }
+  } else {
+    function.symbols.push_back({CodeName(code, generator), 0, code.size()});
+  }
+
+  std::lock_guard<std::mutex> lock(mu_);
+  pending_.push_back(std::move(function));
+  if (static_cast<int>(pending_.size()) >= batch_size_) Register(&pending_);
+}
+
+void GdbJitInterface::Removed(const Code &code) {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    if (pending_[i].code == &code) {
+      pending_.erase(pending_.begin() + i);
+      return;
+    }
+  }
+  auto f = entries_.find(&code);
+  if (f != entries_.end()) Unregister(f->second, &code);
+}
+
+void GdbJitInterface::Flush() {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (!pending_.empty()) Register(&pending_);
+}
+
+int GdbJitInterface::pending() {
+  std::lock_guard<std::mutex> lock(mu_);
+  return pending_.size();
+}
+
+int GdbJitInterface::registered() {
+  std::lock_guard<std::mutex> lock(mu_);
+  return registered_;
+}
+
+void GdbJitInterface::Register(std::vector<Function> *functions) {
+  Entry *entry = new Entry();
+  entry->functions.swap(*functions);
+  entry->symfile = BuildSymbolFile(entry->functions);
+  entry->entry.symfile_addr = entry->symfile.data();
+  entry->entry.symfile_size = entry->symfile.size();
+  for (const Function &function : entry->functions) {
+    entries_[function.code] = entry;
+  }
+  registered_++;
+
+  // Add entry to the front of the descriptor list and notify GDB.
+  std::lock_guard<std::mutex> lock(descriptor_mu);
+  jit_code_entry *e = &entry->entry;
+  e->prev_entry = nullptr;
+  e->next_entry = __jit_debug_descriptor.first_entry;
+  if (e->next_entry != nullptr) e->next_entry->prev_entry = e;
+  __jit_debug_descriptor.first_entry = e;
+  __jit_debug_descriptor.relevant_entry = e;
+  __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+  __jit_debug_register_code();
+}
+
+void GdbJitInterface::Unregister(Entry *entry, const Code *removed) {
+  {
+    // Remove entry from the descriptor list and notify GDB.
+    std::lock_guard<std::mutex> lock(descriptor_mu);
+    jit_code_entry *e = &entry->entry;
+    if (e->prev_entry != nullptr) {
+      e->prev_entry->next_entry = e->next_entry;
+    } else {
+      __jit_debug_descriptor.first_entry = e->next_entry;
+    }
+    if (e->next_entry != nullptr) e->next_entry->prev_entry = e->prev_entry;
+    __jit_debug_descriptor.relevant_entry = e;
+    __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+    __jit_debug_register_code();
+  }
+
+  // Register the other code objects in the symbol file again right away,
+  // so live code stays visible to GDB.
+  std::vector<Function> survivors;
+  for (Function &function : entry->functions) {
+    entries_.erase(function.code);
+    if (removed != nullptr && function.code != removed) {
+      survivors.push_back(std::move(function));
+    }
+  }
+  registered_--;
+  delete entry;
+  if (!survivors.empty()) Register(&survivors);
+}
+
+std::string GdbJitInterface::BuildSymbolFile(
+    const std::vector<Function> &functions) {
+  // The symbol file has a NOBITS text section for each code object at the
+  // address of the code, followed by the symbol table, the symbol string
+  // table, and the section name string table.
+  int num_functions = functions.size();
+  int symtab_index = num_functions + 1;
+  int strtab_index = num_functions + 2;
+  int shstrtab_index = num_functions + 3;
+  int num_sections = num_functions + 4;
+
+  // Section names.
+  std::string shstrtab;
+  shstrtab.push_back(0);
+  int text_name = shstrtab.size();
+  shstrtab.append(".text", 6);
+  int symtab_name = shstrtab.size();
+  shstrtab.append(".symtab", 8);
+  int strtab_name = shstrtab.size();
+  shstrtab.append(".strtab", 8);
+  int shstrtab_name = shstrtab.size();
+  shstrtab.append(".shstrtab", 10);
+
+  // Symbols. Symbol values are relative to the text section for the code.
+  std::vector<Elf64_Sym> symtab(1);
+  std::string strtab;
+  strtab.push_back(0);
+  memset(&symtab[0], 0, sizeof(Elf64_Sym));
+  for (int i = 0; i < num_functions; ++i) {
+    for (const auto &symbol : functions[i].symbols) {
+      Elf64_Sym sym;
+      sym.st_name = strtab.size();
+      sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+      sym.st_other = STV_DEFAULT;
+      sym.st_shndx = i + 1;
+      sym.st_value = symbol.begin;
+      sym.st_size = symbol.end - symbol.begin;
+      symtab.push_back(sym);
+      strtab.append(symbol.name.c_str(), symbol.name.size() + 1);
+    }
+  }
+
+  // Layout of file.
+  size_t symtab_offset = sizeof(Elf64_Ehdr);
+  size_t symtab_size = symtab.size() * sizeof(Elf64_Sym);
+  size_t strtab_offset = symtab_offset + symtab_size;
+  size_t shstrtab_offset = strtab_offset + strtab.size();
+  size_t shdr_offset = (shstrtab_offset + shstrtab.size() + 7) & ~7;
+  size_t size = shdr_offset + num_sections * sizeof(Elf64_Shdr);
+  std::string file(size, 0);
+  char *base = &file[0];
+
+  // File header.
+  Elf64_Ehdr *ehdr = reinterpret_cast<Elf64_Ehdr *>(base);
+  memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+  ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  ehdr->e_type = ET_REL;
+  ehdr->e_machine = EM_X86_64;
+  ehdr->e_version = EV_CURRENT;
+  ehdr->e_shoff = shdr_offset;
+  ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr->e_shentsize = sizeof(Elf64_Shdr);
+  ehdr->e_shnum = num_sections;
+  ehdr->e_shstrndx = shstrtab_index;
+
+  // Tables.
+  memcpy(base + symtab_offset, symtab.data(), symtab_size);
+  memcpy(base + strtab_offset, strtab.data(), strtab.size());
+  memcpy(base + shstrtab_offset, shstrtab.data(), shstrtab.size());
+
+  // Section headers.
+  Elf64_Shdr *shdr = reinterpret_cast<Elf64_Shdr *>(base + shdr_offset);
+  for (int i = 0; i < num_functions; ++i) {
+    Elf64_Shdr *text = &shdr[i + 1];
+    text->sh_name = text_name;
+    text->sh_type = SHT_NOBITS;
+    text->sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    text->sh_addr = reinterpret_cast<Elf64_Addr>(functions[i].code->begin());
+    text->sh_size = functions[i].code->size();
+    text->sh_addralign = 16;
+  }
+
+  Elf64_Shdr *sym = &shdr[symtab_index];
+  sym->sh_name = symtab_name;
+  sym->sh_type = SHT_SYMTAB;
+  sym->sh_offset = symtab_offset;
+  sym->sh_size = symtab_size;
+  sym->sh_link = strtab_index;
+  sym->sh_info = 1;
+  sym->sh_addralign = 8;
+  sym->sh_entsize = sizeof(Elf64_Sym);
+
+  Elf64_Shdr *str = &shdr[strtab_index];
+  str->sh_name = strtab_name;
+  str->sh_type = SHT_STRTAB;
+  str->sh_offset = strtab_offset;
+  str->sh_size = strtab.size();
+  str->sh_addralign = 1;
+
+  Elf64_Shdr *shstr = &shdr[shstrtab_index];
+  shstr->sh_name = shstrtab_name;
+  shstr->sh_type = SHT_STRTAB;
+  shstr->sh_offset = shstrtab_offset;
+  shstr->sh_size = shstrtab.size();
+  shstr->sh_addralign = 1;
+
+  return file;
+}
+
+}  // namespace jit
+}  // namespace sling
@@ -0,0 +1,98 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_GDBJIT_H_
+#define JIT_GDBJIT_H_
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "jit/code.h"
+
+namespace sling {
+namespace jit {
+
+// Code observer that makes generated code visible to GDB through the GDB JIT
+// interface. For each installed code object, an in-memory ELF symbol file
+// with a function symbol for the code, or for each symbol added to the code
+// generator, is registered in the JIT descriptor that GDB reads from the
+// process, so backtraces and breakpoints in generated code show function
+// names. This also works for core dumps, since GDB reads the registered symbol
+// files from the memory of the process.
+//
+// Registration is cheap enough to leave on in production. Installed code is
+// queued, and the queued code objects are registered together in a single
+// symbol file when the batch is full or when Flush() is called. Registration
+// only touches process memory and calls an empty function, which GDB sets a
+// breakpoint on when it is attached. When a code object is removed, the symbol
+// file it is in is unregistered, and the other live code objects in the file
+// are registered again right away in a new symbol file.
+//
+// Queued code objects are not visible to GDB until they are registered, so
+// callers should call Flush() after compiling a set of functions, e.g. after
+// the startup compiles, instead of waiting for the batch to fill up.
+class GdbJitInterface : public CodeObserver {
+ public:
+  // Default number of code objects registered in each symbol file.
+  static const int kDefaultBatchSize = 16;
+
+  explicit GdbJitInterface(int batch_size = kDefaultBatchSize);
+
+  // Unregister all symbol files registered by this observer.
+  ~GdbJitInterface() override;
+
+  void Installed(const Code &code, const CodeGenerator *generator) override;
+  void Removed(const Code &code) override;
+
+  // Register all queued code objects.
+  void Flush();
+
+  // Number of code objects waiting to be registered.
+  int pending();
+
+  // Number of symbol files currently registered by this observer.
+  int registered();
+
+ private:
+  struct Entry;
+
+  // Symbols for a code object.
+  struct Function {
+    const Code *code;                            // code object
+    std::vector<CodeGenerator::Symbol> symbols;  // symbols in final code
+  };
+
+  // Register code objects in a new symbol file. The functions are moved to
+  // the new entry.
+  void Register(std::vector<Function> *functions);
+
+  // Unregister symbol file and register its other code objects again.
+  void Unregister(Entry *entry, const Code *removed);
+
+  // Build ELF symbol file for code objects.
+  static std::string BuildSymbolFile(const std::vector<Function> &functions);
+
+  // Number of code objects in each symbol file.
+  int batch_size_;
+
+  // Code objects waiting to be registered.
+  std::vector<Function> pending_;
+
+  // Symbol file for each registered code object.
+  std::unordered_map<const Code *, Entry *> entries_;
+
+  // Number of registered symbol files.
+  int registered_ = 0;
+
+  // Mutex for serializing access to the pending and registered code.
+  std::mutex mu_;
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_GDBJIT_H_
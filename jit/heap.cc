@@ -0,0 +1,531 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <link.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "jit/heap.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+namespace sling {
+namespace jit {
+
+// Maximum distance between code and targets of rel32 calls. A margin is left
+// for the size of the code block itself.
+static const uintptr_t kMaxReach = (1ul << 31) - (64 << 20);
+
+// Search for executable segments of loaded objects.
+struct TextSearch {
+  const void *symbol;   // symbol in object, or null for main program
+  uintptr_t lo = 0;     // start of text segments
+  uintptr_t hi = 0;     // end of text segments
+  bool found = false;   // object found
+};
+
+static int FindText(struct dl_phdr_info *info, size_t size, void *data) {
+  TextSearch *search = static_cast<TextSearch *>(data);
+  uintptr_t lo = UINTPTR_MAX;
+  uintptr_t hi = 0;
+  bool match = search->symbol == nullptr;
+  uintptr_t symbol = reinterpret_cast<uintptr_t>(search->symbol);
+  for (int i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+    if (phdr.p_type != PT_LOAD) continue;
+    uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+    uintptr_t end = start + phdr.p_memsz;
+    if (symbol >= start && symbol < end) match = true;
+    if (phdr.p_flags & PF_X) {
+      lo = std::min(lo, start);
+      hi = std::max(hi, end);
+    }
+  }
+  if (!match || hi == 0) return 0;
+
+  // The main program is the first object.
+  search->lo = lo;
+  search->hi = hi;
+  search->found = true;
+  return 1;
+}
+
+CodeHeap::CodeHeap() : CodeHeap(Options()) {}
+
+CodeHeap::CodeHeap(const Options &options) : options_(options) {
+  page_size_ = sysconf(_SC_PAGESIZE);
+  options_.region_size =
+      (options_.region_size + page_size_ - 1) & ~(page_size_ - 1);
+  if (options_.region_size < kMaxSmallSize) {
+    options_.region_size = kMaxSmallSize;
+  }
+  if (options_.huge_pages) {
+    options_.region_size =
+        (options_.region_size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  }
+  if (options_.near_text) {
+    TextSearch search;
+    search.symbol = nullptr;
+    dl_iterate_phdr(FindText, &search);
+    if (search.found) near_.emplace_back(search.lo, search.hi);
+  }
+}
+
+CodeHeap::~CodeHeap() {
+  for (auto &it : regions_) Unmap(&it.second);
+}
+
+int CodeHeap::SizeClass(int size) {
+  int cls = 0;
+  while (ClassSize(cls) < size) cls++;
+  return cls;
+}
+
+void *CodeHeap::Map(size_t size, int prot, int flags, int fd,
+                    bool aligned, bool near) {
+  void *mem = MAP_FAILED;
+  if (near && options_.near_text && !near_.empty()) {
+    // Map memory at a free address near the text segments. Older kernels
+    // treat the address as a hint, so the address of the mapping is checked.
+    Address addr = FindNearSpace(size, aligned ? kHugePageSize : page_size_);
+    if (addr != nullptr) {
+      mem = mmap(addr, size, prot, flags | MAP_FIXED_NOREPLACE, fd, 0);
+      if (mem != MAP_FAILED && mem != addr) {
+        munmap(mem, size);
+        mem = MAP_FAILED;
+      }
+    }
+  }
+
+  if (mem == MAP_FAILED && !aligned) {
+    mem = mmap(nullptr, size, prot, flags, fd, 0);
+  } else if (mem == MAP_FAILED) {
+    // Reserve address space with room for alignment and map the memory at
+    // the first huge page boundary inside the reservation.
+    size_t span = size + kHugePageSize;
+    void *reservation =
+        mmap(nullptr, span, PROT_NONE,
+             MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED) return MAP_FAILED;
+    uintptr_t start = reinterpret_cast<uintptr_t>(reservation);
+    uintptr_t aligned_start =
+        (start + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    void *addr = reinterpret_cast<void *>(aligned_start);
+    mem = mmap(addr, size, prot, flags | MAP_FIXED, fd, 0);
+    if (mem == MAP_FAILED) {
+      munmap(reservation, span);
+      return MAP_FAILED;
+    }
+
+    // Release unused parts of the reservation.
+    if (aligned_start > start) {
+      munmap(reservation, aligned_start - start);
+    }
+    uintptr_t end = aligned_start + size;
+    if (start + span > end) {
+      munmap(reinterpret_cast<void *>(end), start + span - end);
+    }
+  }
+
+  if (mem != MAP_FAILED && aligned) madvise(mem, size, MADV_HUGEPAGE);
+  return mem;
+}
+
+Address CodeHeap::FindNearSpace(size_t size, size_t alignment) {
+  // Compute window of addresses that are within reach of all text segments.
+  uintptr_t lo = 0;
+  uintptr_t hi = UINTPTR_MAX;
+  for (auto &text : near_) {
+    if (text.second > kMaxReach) lo = std::max(lo, text.second - kMaxReach);
+    hi = std::min(hi, text.first + kMaxReach);
+  }
+  if (hi <= lo || hi - lo < size) return nullptr;
+
+  // Prefer addresses just below the main program, leaving the space above it
+  // for the data segment to grow.
+  uintptr_t target = near_[0].first > size ? near_[0].first - size : 0;
+
+  // Find the closest gap in the memory map that fits the region.
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (maps == nullptr) return nullptr;
+  uintptr_t best = 0;
+  uintptr_t best_distance = UINTPTR_MAX;
+  uintptr_t gap = 1ul << 16;
+  char line[512];
+  bool done = false;
+  while (!done) {
+    unsigned long start, end;
+    if (fgets(line, sizeof(line), maps) == nullptr) {
+      start = end = hi;
+      done = true;
+    } else if (sscanf(line, "%lx-%lx", &start, &end) != 2) {
+      continue;
+    }
+
+    // Check gap between the previous mapping and this mapping.
+    uintptr_t first = std::max(gap, lo);
+    uintptr_t last = std::min<uintptr_t>(start, hi);
+    first = (first + alignment - 1) & ~(alignment - 1);
+    if (last > first && last - first >= size) {
+      last = (last - size) & ~(alignment - 1);
+      uintptr_t addr = std::min(std::max(target, first), last);
+      uintptr_t distance = addr > target ? addr - target : target - addr;
+      if (distance < best_distance) {
+        best = addr;
+        best_distance = distance;
+      }
+    }
+    gap = std::max<uintptr_t>(gap, end);
+  }
+  fclose(maps);
+  return reinterpret_cast<Address>(best);
+}
+
+bool CodeHeap::AddNearLibrary(const void *symbol) {
+  TextSearch search;
+  search.symbol = symbol;
+  dl_iterate_phdr(FindText, &search);
+  if (!search.found) return false;
+  std::lock_guard<std::mutex> lock(mu_);
+  near_.emplace_back(search.lo, search.hi);
+  return true;
+}
+
+bool CodeHeap::Reachable(Address code, const void *target) {
+  uintptr_t lo = reinterpret_cast<uintptr_t>(code);
+  uintptr_t hi = lo;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    Region *region = Lookup(code);
+    if (region != nullptr) {
+      lo = reinterpret_cast<uintptr_t>(region->base);
+      hi = lo + region->size;
+    }
+  }
+  uintptr_t addr = reinterpret_cast<uintptr_t>(target);
+  return addr + kMaxReach >= hi && addr <= lo + kMaxReach;
+}
+
+CodeHeap::Region *CodeHeap::NewRegion(size_t size, bool large) {
+  Address base;
+  Address alias;
+  bool huge = options_.huge_pages && size % kHugePageSize == 0;
+  bool hugetlb = false;
+  if (options_.dual_mapped) {
+    // Map the same anonymous file twice. Try to use a file in the hugetlbfs
+    // first, and fall back to a regular memfd if that fails.
+    void *rw = MAP_FAILED;
+    void *rx = MAP_FAILED;
+    for (int attempt = huge ? 0 : 1; attempt < 2; ++attempt) {
+      hugetlb = attempt == 0;
+      int fd = memfd_create("jit", MFD_CLOEXEC | (hugetlb ? MFD_HUGETLB : 0));
+      if (fd == -1) continue;
+      if (ftruncate(fd, size) == 0) {
+        int flags = MAP_SHARED;
+        rw = Map(size, PROT_READ | PROT_WRITE, flags, fd, huge, false);
+        rx = Map(size, PROT_READ | PROT_EXEC, flags, fd, huge, true);
+      }
+      close(fd);
+      if (rw != MAP_FAILED && rx != MAP_FAILED) break;
+      if (rw != MAP_FAILED) munmap(rw, size);
+      if (rx != MAP_FAILED) munmap(rx, size);
+      rw = rx = MAP_FAILED;
+    }
+    if (rw == MAP_FAILED) return nullptr;
+    base = static_cast<Address>(rx);
+    alias = static_cast<Address>(rw);
+  } else {
+    void *rw = MAP_FAILED;
+    int flags = MAP_ANONYMOUS | MAP_PRIVATE;
+    if (huge) {
+      rw = Map(size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1,
+               true, true);
+      hugetlb = rw != MAP_FAILED;
+    }
+    if (rw == MAP_FAILED) {
+      rw = Map(size, PROT_READ | PROT_WRITE, flags, -1, huge, true);
+    }
+    if (rw == MAP_FAILED) return nullptr;
+    base = alias = static_cast<Address>(rw);
+  }
+
+  Region &region = regions_[base];
+  region.base = base;
+  region.alias = alias;
+  region.size = size;
+  region.large = large;
+  region.hugetlb = hugetlb;
+  reserved_ += size;
+
+  if (options_.dual_mapped) {
+    // Dual-mapped regions are always both writable and executable.
+    region.executable = true;
+  } else {
+    // New regions are born writable, so they need to be protected when the
+    // blocks in the region have been committed.
+    dirty_.push_back(&region);
+  }
+  return &region;
+}
+
+void CodeHeap::Unmap(Region *region) {
+  munmap(region->base, region->size);
+  if (region->alias != region->base) munmap(region->alias, region->size);
+}
+
+CodeHeap::Region *CodeHeap::Lookup(Address addr) {
+  auto it = regions_.upper_bound(addr);
+  if (it == regions_.begin()) return nullptr;
+  --it;
+  Region *region = &it->second;
+  if (addr >= region->base + region->size) return nullptr;
+  return region;
+}
+
+void CodeHeap::MakeWritable(Region *region) {
+  region->writers++;
+  if (region->writable) return;
+  int prot = PROT_READ | PROT_WRITE;
+  if (region->executable) prot |= PROT_EXEC;
+  mprotect(region->base, region->size, prot);
+  region->writable = true;
+  dirty_.push_back(region);
+}
+
+void CodeHeap::Protect(Region *region) {
+  mprotect(region->base, region->size, PROT_READ | PROT_EXEC);
+  region->writable = false;
+  region->executable = true;
+  dirty_.erase(std::remove(dirty_.begin(), dirty_.end(), region),
+               dirty_.end());
+}
+
+void CodeHeap::RetireCurrent() {
+  // Split the remaining space into the largest possible blocks.
+  for (int cls = kNumSizeClasses - 1; cls >= 0; --cls) {
+    while (limit_ - top_ >= ClassSize(cls)) {
+      free_[cls].push_back(top_);
+      top_ += ClassSize(cls);
+    }
+  }
+  current_ = nullptr;
+  top_ = limit_ = nullptr;
+}
+
+Address CodeHeap::Allocate(int size) {
+  std::lock_guard<std::mutex> lock(mu_);
+  // DCHECK(updates_ > 0);
+  if (size <= 0) size = 1;
+
+  // Large blocks get a separate region.
+  if (size > kMaxSmallSize) {
+    size_t granularity = options_.huge_pages ? kHugePageSize : page_size_;
+    size_t bytes = (size + granularity - 1) & ~(granularity - 1);
+    Region *region = NewRegion(bytes, true);
+    if (region == nullptr) return nullptr;
+    region->live = 1;
+    region->writers = 1;
+    allocated_ += bytes;
+    return region->base;
+  }
+
+  // Try to get block from free list.
+  int cls = SizeClass(size);
+  int bytes = ClassSize(cls);
+  Address block = nullptr;
+  Region *region = nullptr;
+  if (!free_[cls].empty()) {
+    block = free_[cls].back();
+    free_[cls].pop_back();
+    region = Lookup(block);
+  } else {
+    // Allocate block from current region.
+    if (current_ == nullptr || limit_ - top_ < bytes) {
+      if (current_ != nullptr) RetireCurrent();
+      current_ = NewRegion(options_.region_size, false);
+      if (current_ == nullptr) return nullptr;
+      top_ = current_->base;
+      limit_ = current_->base + current_->size;
+    }
+    block = top_;
+    top_ += bytes;
+    region = current_;
+  }
+
+  MakeWritable(region);
+  region->live++;
+  allocated_ += bytes;
+  return block;
+}
+
+void CodeHeap::Commit(Address block) {
+  std::lock_guard<std::mutex> lock(mu_);
+  Region *region = Lookup(block);
+  // DCHECK(region != nullptr);
+  if (options_.dual_mapped) return;
+  if (--region->writers == 0 && updates_ == 0) {
+    Protect(region);
+  } else if (!region->executable) {
+    // The region is still being written, but the committed block must be
+    // executable right away.
+    mprotect(region->base, region->size, PROT_READ | PROT_WRITE | PROT_EXEC);
+    region->executable = true;
+  }
+}
+
+void CodeHeap::Shrink(Address block, int size, int used) {
+  std::lock_guard<std::mutex> lock(mu_);
+  Region *region = Lookup(block);
+  // DCHECK(region != nullptr);
+  if (region->large) {
+    // Unmap the unused pages at the end of the region.
+    size_t granularity = options_.huge_pages ? kHugePageSize : page_size_;
+    size_t keep = (used + granularity - 1) & ~(granularity - 1);
+    if (keep == 0) keep = granularity;
+    if (keep < region->size) {
+      size_t excess = region->size - keep;
+      munmap(region->base + keep, excess);
+      if (region->alias != region->base) munmap(region->alias + keep, excess);
+      region->size = keep;
+      allocated_ -= excess;
+      reserved_ -= excess;
+    }
+  } else {
+    // Split the unused part of the block into blocks of smaller size
+    // classes. The block has size 2^n * kAlignment and the unused part
+    // consists of blocks of 2^k * kAlignment for k from the size class of
+    // the used part up to n - 1.
+    int cls = SizeClass(size <= 0 ? 1 : size);
+    int keep = SizeClass(used <= 0 ? 1 : used);
+    Address p = block + ClassSize(keep);
+    for (int c = keep; c < cls; ++c) {
+      free_[c].push_back(p);
+      p += ClassSize(c);
+    }
+    allocated_ -= ClassSize(cls) - ClassSize(keep);
+  }
+}
+
+Address CodeHeap::Writable(Address addr) {
+  if (!options_.dual_mapped) return addr;
+  std::lock_guard<std::mutex> lock(mu_);
+  Region *region = Lookup(addr);
+  // DCHECK(region != nullptr);
+  return region->alias + (addr - region->base);
+}
+
+Address CodeHeap::Reopen(Address addr) {
+  std::lock_guard<std::mutex> lock(mu_);
+  Region *region = Lookup(addr);
+  // DCHECK(region != nullptr);
+  if (options_.dual_mapped) return region->alias + (addr - region->base);
+  MakeWritable(region);
+  return addr;
+}
+
+void CodeHeap::Free(Address block, int size) {
+  std::lock_guard<std::mutex> lock(mu_);
+  Region *region = Lookup(block);
+  // DCHECK(region != nullptr);
+  if (region == nullptr) return;
+  if (region->large) {
+    // Unmap region for large block. A large region can only be dirty if the
+    // block is freed in the update that allocated it.
+    dirty_.erase(std::remove(dirty_.begin(), dirty_.end(), region),
+                 dirty_.end());
+    Unmap(region);
+    allocated_ -= region->size;
+    reserved_ -= region->size;
+    regions_.erase(region->base);
+  } else {
+    int cls = SizeClass(size <= 0 ? 1 : size);
+    free_[cls].push_back(block);
+    region->live--;
+    allocated_ -= ClassSize(cls);
+  }
+}
+
+void CodeHeap::BeginUpdate() {
+  std::lock_guard<std::mutex> lock(mu_);
+  updates_++;
+}
+
+void CodeHeap::EndUpdate() {
+  std::lock_guard<std::mutex> lock(mu_);
+  // DCHECK(updates_ > 0);
+  if (--updates_ > 0) return;
+
+  // Make all modified regions without uncommitted blocks executable and
+  // remove write permissions.
+  std::vector<Region *> dirty;
+  dirty.swap(dirty_);
+  for (Region *region : dirty) {
+    if (region->writers > 0) {
+      dirty_.push_back(region);
+    } else {
+      Protect(region);
+    }
+  }
+}
+
+void CodeHeap::GetRegions(std::vector<RegionInfo> *regions) {
+  std::lock_guard<std::mutex> lock(mu_);
+  regions->clear();
+  for (auto &it : regions_) {
+    const Region &region = it.second;
+    RegionInfo info;
+    info.base = region.base;
+    info.size = region.size;
+    info.huge = region.hugetlb ? region.size : 0;
+    info.hugetlb = region.hugetlb;
+    regions->push_back(info);
+  }
+  if (!options_.huge_pages) return;
+
+  // Get the transparent huge page usage for the regions from the memory map.
+  FILE *smaps = fopen("/proc/self/smaps", "r");
+  if (smaps == nullptr) return;
+  char line[256];
+  uintptr_t start = 0;
+  uintptr_t end = 0;
+  while (fgets(line, sizeof(line), smaps)) {
+    unsigned long lo, hi;
+    if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+      start = lo;
+      end = hi;
+      continue;
+    }
+
+    // Anonymous memory reports AnonHugePages and memfd memory reports
+    // ShmemPmdMapped.
+    char key[64];
+    unsigned long kb;
+    if (sscanf(line, "%63[^:]: %lu kB", key, &kb) != 2) continue;
+    if (strcmp(key, "AnonHugePages") != 0 &&
+        strcmp(key, "ShmemPmdMapped") != 0) {
+      continue;
+    }
+    if (kb == 0) continue;
+    for (RegionInfo &info : *regions) {
+      if (info.hugetlb) continue;
+      uintptr_t base = reinterpret_cast<uintptr_t>(info.base);
+      if (start <= base && base + info.size <= end) {
+        // The mapping can have been merged with adjacent mappings, so the
+        // huge page usage is clipped to the region size.
+        info.huge += kb * 1024;
+        if (info.huge > info.size) info.huge = info.size;
+      }
+    }
+  }
+  fclose(smaps);
+}
+
+}  // namespace jit
+}  // namespace sling
+
@@ -0,0 +1,242 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_HEAP_H_
+#define JIT_HEAP_H_
+
+#include <stddef.h>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "jit/memory.h"
+
+namespace sling {
+namespace jit {
+
+// A code heap packs many code blocks into large shared memory regions instead
+// of mapping separate pages for each code object. Small blocks are allocated
+// from power-of-two size classes with a free list per class, and blocks that
+// are larger than the largest size class get a region of their own. All
+// blocks start on a cache line boundary.
+//
+// Newly allocated blocks are writable until they are committed. The region
+// for a block is made writable when the block is allocated, and when the last
+// block being written in the region is committed, the whole region is made
+// executable again with a single mprotect call. Regions that already contain
+// live code are kept executable while being written, so other threads can
+// keep running code in the heap. Updates can be used for batching many
+// allocations, in which case the regions are only made read-only again when
+// the outermost update ends.
+//
+// Alternatively, the heap can map each region twice from a memfd, once
+// read/write and once read/execute. Code is written through the writable
+// alias and executed through the executable view, so the memory protection
+// never needs to be changed. Block addresses returned by the heap are always
+// the executable addresses, and Writable() translates these to the addresses
+// in the writable alias.
+//
+// To reduce iTLB misses, regions can be backed by huge pages. The heap first
+// tries to map explicit huge pages (MAP_HUGETLB). If no huge pages are
+// available, it falls back to regular pages aligned on huge page boundaries
+// and asks the kernel to back these with transparent huge pages.
+//
+// Regions can also be placed within +/-2GB of the text segment of the main
+// program and of registered shared libraries, so code in the heap can call
+// functions in these with direct 32-bit relative calls.
+class CodeHeap {
+ public:
+  // Alignment of code blocks.
+  static const int kAlignment = 64;
+
+  // Size classes are powers of two from kAlignment to kMaxSmallSize.
+  static const int kNumSizeClasses = 9;
+  static const int kMaxSmallSize = kAlignment << (kNumSizeClasses - 1);
+
+  // Default size of memory regions for small blocks.
+  static const size_t kDefaultRegionSize = 1 << 20;
+
+  // Size of huge pages.
+  static const size_t kHugePageSize = 2 << 20;
+
+  // Code heap configuration.
+  struct Options {
+    // Size of memory regions for small blocks.
+    size_t region_size = kDefaultRegionSize;
+
+    // Map regions twice with separate writable and executable views.
+    bool dual_mapped = false;
+
+    // Back regions with huge pages. Region sizes are rounded up to a
+    // multiple of the huge page size.
+    bool huge_pages = false;
+
+    // Place regions within reach of rel32 calls to the text of the main
+    // program and registered libraries. If no such space is available,
+    // regions are placed anywhere.
+    bool near_text = false;
+  };
+
+  // Information about memory region in heap.
+  struct RegionInfo {
+    Address base;   // start of region
+    size_t size;    // size of region
+    size_t huge;    // number of bytes in region backed by huge pages
+    bool hugetlb;   // region is mapped with explicit huge pages
+  };
+
+  CodeHeap();
+  explicit CodeHeap(const Options &options);
+
+  // Unmap all memory regions. All code blocks in the heap become invalid.
+  ~CodeHeap();
+
+  // Allocate block for code of the given size. The block is writable until it
+  // is committed. Returns null if memory could not be allocated.
+  Address Allocate(int size);
+
+  // Commit block after the code has been written to it. The block becomes
+  // executable.
+  void Commit(Address block);
+
+  // Shrink uncommitted block allocated with the given size, so only the first
+  // 'used' bytes are kept. The unused part of the block is returned to the
+  // heap, and the block must later be freed with the new size.
+  void Shrink(Address block, int size, int used);
+
+  // Return the address where code for an executable address in the heap must
+  // be written.
+  Address Writable(Address addr);
+
+  // Make committed code writable again for patching it. The code stays
+  // executable while it is being patched, and it must be committed again when
+  // patching is done. Returns the address where the code must be written.
+  Address Reopen(Address addr);
+
+  // Return code block to the heap. The size must be the same as the size
+  // used for allocating the block.
+  void Free(Address block, int size);
+
+  // Begin updating code heap. Updates can be nested, and updates from
+  // different threads can overlap. Regions are not made read-only while the
+  // heap is being updated.
+  void BeginUpdate();
+
+  // End update. When the last update ends, all regions modified during the
+  // updates, which have no uncommitted blocks, are made read-only.
+  void EndUpdate();
+
+  // Number of bytes of memory mapped by the heap.
+  size_t reserved() const { return reserved_; }
+
+  // Number of bytes allocated for code blocks.
+  size_t allocated() const { return allocated_; }
+
+  // Number of memory regions in the heap.
+  int regions() const { return regions_.size(); }
+
+  // Check if regions have separate writable and executable views.
+  bool dual_mapped() const { return options_.dual_mapped; }
+
+  // Register the shared library containing the symbol, so new regions are
+  // placed within rel32 reach of its text. Returns false if the symbol is not
+  // in a loaded object.
+  bool AddNearLibrary(const void *symbol);
+
+  // Check if address can be reached with a rel32 displacement from anywhere
+  // in the heap region containing the code address.
+  bool Reachable(Address code, const void *target);
+
+  // Get information about the memory regions in the heap, including how much
+  // of each region is actually backed by huge pages. Transparent huge page
+  // usage is read from /proc/self/smaps and is only a snapshot.
+  void GetRegions(std::vector<RegionInfo> *regions);
+
+ private:
+  // Memory region with code blocks.
+  struct Region {
+    Address base;             // start of memory region
+    Address alias;            // start of writable view of region
+    size_t size;              // size of memory region
+    int live = 0;             // number of allocated blocks in region
+    int writers = 0;          // number of uncommitted blocks in region
+    bool large = false;       // region holds a single large block
+    bool hugetlb = false;     // region is mapped with explicit huge pages
+    bool writable = true;     // region is currently writable
+    bool executable = false;  // region is currently executable
+  };
+
+  // Size class for block size.
+  static int SizeClass(int size);
+
+  // Block size for size class.
+  static int ClassSize(int cls) { return kAlignment << cls; }
+
+  // Map new memory region. Returns null if the region could not be mapped.
+  Region *NewRegion(size_t size, bool large);
+
+  // Map memory for region. If aligned is true, the memory is aligned to a huge
+  // page boundary and marked for transparent huge pages. If near is true, the
+  // memory is placed near the registered text segments if possible.
+  void *Map(size_t size, int prot, int flags, int fd, bool aligned, bool near);
+
+  // Find unmapped address space within rel32 reach of the registered text
+  // segments. Returns null if no such space is available.
+  Address FindNearSpace(size_t size, size_t alignment);
+
+  // Unmap memory region.
+  void Unmap(Region *region);
+
+  // Find region that contains address.
+  Region *Lookup(Address addr);
+
+  // Make region writable for a new block.
+  void MakeWritable(Region *region);
+
+  // Make region executable and remove write permissions.
+  void Protect(Region *region);
+
+  // Add unused tail of current region to the free lists.
+  void RetireCurrent();
+
+  // Configuration.
+  Options options_;
+
+  // Page size.
+  size_t page_size_;
+
+  // Text segments that regions should be placed near.
+  std::vector<std::pair<uintptr_t, uintptr_t>> near_;
+
+  // Memory regions indexed by base address.
+  std::map<Address, Region> regions_;
+
+  // Regions that have been made writable.
+  std::vector<Region *> dirty_;
+
+  // Free lists for each size class.
+  std::vector<Address> free_[kNumSizeClasses];
+
+  // Current region for new small blocks.
+  Region *current_ = nullptr;
+  Address top_ = nullptr;
+  Address limit_ = nullptr;
+
+  // Number of active updates.
+  int updates_ = 0;
+
+  // Statistics.
+  size_t reserved_ = 0;
+  size_t allocated_ = 0;
+
+  // Mutex for serializing access to heap.
+  std::mutex mu_;
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_HEAP_H_
+
@@ -61,6 +61,7 @@ namespace jit {
   V(sbb)                              \
   V(sub)                              \
   V(test)                             \
+  V(xadd)                             \
   V(xchg)                             \
   V(xor)
 
@@ -0,0 +1,109 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jit/jumptable.h"
+
+#include <algorithm>
+
+namespace sling {
+namespace jit {
+
+void JumpTable::Add(int32_t value, Label *target) {
+  cases_.emplace_back(value, target);
+}
+
+bool JumpTable::dense() const {
+  if (cases_.size() < kMinTableCases) return false;
+  int64_t lo = cases_.front().first;
+  int64_t hi = cases_.front().first;
+  for (auto &c : cases_) {
+    lo = std::min(lo, static_cast<int64_t>(c.first));
+    hi = std::max(hi, static_cast<int64_t>(c.first));
+  }
+  int64_t range = hi - lo + 1;
+  int64_t count = cases_.size();
+  return count * 100 >= range * kMinDensityPercent;
+}
+
+void JumpTable::Dispatch(Register value, Register scratch, Label *otherwise) {
+  // Sort cases by value and remove duplicates.
+  std::stable_sort(cases_.begin(), cases_.end(),
+      [](const std::pair<int32_t, Label *> &a,
+         const std::pair<int32_t, Label *> &b) {
+        return a.first < b.first;
+      });
+  cases_.erase(std::unique(cases_.begin(), cases_.end(),
+      [](const std::pair<int32_t, Label *> &a,
+         const std::pair<int32_t, Label *> &b) {
+        return a.first == b.first;
+      }), cases_.end());
+
+  if (cases_.empty()) {
+    masm_->jmp(otherwise);
+  } else if (dense()) {
+    EmitTable(value, scratch, otherwise);
+  } else {
+    EmitTree(value, 0, cases_.size() - 1, otherwise);
+  }
+}
+
+void JumpTable::EmitTable(Register value, Register scratch,
+                          Label *otherwise) {
+  // Subtract the smallest value and check that the index is within the
+  // table. The 32-bit operations clear the upper half of the register.
+  int32_t lo = cases_.front().first;
+  int32_t hi = cases_.back().first;
+  uint32_t size = static_cast<uint32_t>(hi) - static_cast<uint32_t>(lo) + 1;
+  if (lo != 0) {
+    masm_->subl(value, Immediate(lo));
+  } else {
+    masm_->movl(value, value);
+  }
+  masm_->cmpl(value, Immediate(size));
+  masm_->j(above_equal, otherwise);
+
+  // Jump to the table address plus the offset in the table entry.
+  Label table;
+  masm_->leaq(scratch, Operand(&table));
+  masm_->movsxlq(value, Operand(scratch, value, times_4, 0));
+  masm_->addq(scratch, value);
+  masm_->jmp(scratch);
+
+  // Emit table with offsets of the case labels relative to the table.
+  masm_->DataAlign(4);
+  masm_->bind(&table);
+  auto c = cases_.begin();
+  for (uint32_t i = 0; i < size; ++i) {
+    if (c != cases_.end() && static_cast<uint32_t>(c->first - lo) == i) {
+      masm_->dd(c->second, &table);
+      ++c;
+    } else {
+      masm_->dd(otherwise, &table);
+    }
+  }
+}
+
+void JumpTable::EmitTree(Register value, int lo, int hi, Label *otherwise) {
+  if (hi - lo < kMaxLinearCases) {
+    // Compare with each of the remaining cases.
+    for (int i = lo; i <= hi; ++i) {
+      masm_->cmpl(value, Immediate(cases_[i].first));
+      masm_->j(equal, cases_[i].second);
+    }
+    masm_->jmp(otherwise);
+    return;
+  }
+
+  // Split the cases at the middle value.
+  int mid = (lo + hi + 1) / 2;
+  Label upper;
+  masm_->cmpl(value, Immediate(cases_[mid].first));
+  masm_->j(greater_equal, &upper);
+  EmitTree(value, lo, mid - 1, otherwise);
+  masm_->bind(&upper);
+  EmitTree(value, mid, hi, otherwise);
+}
+
+}  // namespace jit
+}  // namespace sling
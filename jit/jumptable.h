@@ -0,0 +1,59 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_JUMPTABLE_H_
+#define JIT_JUMPTABLE_H_
+
+#include <utility>
+#include <vector>
+
+#include "jit/assembler.h"
+
+namespace sling {
+namespace jit {
+
+// A jump table dispatches on a 32-bit integer value in a register to a set
+// of case labels. Dense cases are dispatched through a table of 32-bit label
+// offsets relative to the start of the table, which is placed right after the
+// dispatch code. Sparse cases are dispatched through a binary search tree of
+// compares.
+class JumpTable {
+ public:
+  // Minimum number of cases and density of case values for using a table.
+  static const int kMinTableCases = 4;
+  static const int kMinDensityPercent = 40;
+
+  // Maximum number of cases for compares in leaves of the search tree.
+  static const int kMaxLinearCases = 3;
+
+  explicit JumpTable(Assembler *masm) : masm_(masm) {}
+
+  // Add case for value. Only the first case is used for duplicate values.
+  void Add(int32_t value, Label *target);
+
+  // Check if cases are dense enough for using a table.
+  bool dense() const;
+
+  // Emit dispatch on the value in a register. Values without a case jump to
+  // the default label. The value and scratch registers are clobbered.
+  void Dispatch(Register value, Register scratch, Label *otherwise);
+
+ private:
+  // Emit dispatch through table.
+  void EmitTable(Register value, Register scratch, Label *otherwise);
+
+  // Emit binary search tree for the cases from lo to hi.
+  void EmitTree(Register value, int lo, int hi, Label *otherwise);
+
+  // Assembler for emitting dispatch code.
+  Assembler *masm_;
+
+  // Case values and labels sorted by value.
+  std::vector<std::pair<int32_t, Label *>> cases_;
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_JUMPTABLE_H_
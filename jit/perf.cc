@@ -0,0 +1,224 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jit/perf.h"
+
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace sling {
+namespace jit {
+
+PerfMap::PerfMap()
+    : PerfMap("/tmp/perf-" + std::to_string(getpid()) + ".map") {}
+
+PerfMap::PerfMap(const std::string &filename) {
+  file_ = fopen(filename.c_str(), "a");
+}
+
+PerfMap::~PerfMap() {
+  if (file_ != nullptr) fclose(file_);
+}
+
+void PerfMap::Installed(const Code &code, const CodeGenerator *generator) {
+  if (file_ == nullptr) return;
+  fprintf(file_, "%lx %x %s\n",
+          reinterpret_cast<unsigned long>(code.begin()), code.size(),
+          CodeName(code, generator).c_str());
+  fflush(file_);
+}
+
+// Jitdump file format.
+namespace {
+
+const uint32_t kJitDumpMagic = 0x4A695444;
+const uint32_t kJitDumpVersion = 1;
+
+enum JitDumpRecordType {
+  kJitCodeLoad = 0,
+  kJitCodeDebugInfo = 2,
+  kJitCodeUnwindingInfo = 4,
+};
+
+struct JitDumpHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct JitDumpRecord {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+};
+
+struct JitCodeLoad {
+  JitDumpRecord header;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+};
+
+struct JitDebugInfo {
+  JitDumpRecord header;
+  uint64_t code_addr;
+  uint64_t nr_entry;
+};
+
+struct JitDebugEntry {
+  uint64_t addr;
+  uint32_t line;
+  uint32_t discrim;
+};
+
+struct JitUnwindingInfo {
+  JitDumpRecord header;
+  uint64_t unwinding_size;
+  uint64_t eh_frame_hdr_size;
+  uint64_t mapped_size;
+};
+
+// Size of the .eh_frame_hdr section following the .eh_frame section in the
+// unwinding information.
+const int kEhFrameHdrSize = 20;
+
+// Timestamp for jitdump records. This must be the clock used by perf record.
+uint64_t Timestamp() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+}  // namespace
+
+JitDump::JitDump(const std::string &directory) {
+  std::string filename =
+      directory + "/jit-" + std::to_string(getpid()) + ".dump";
+  file_ = fopen(filename.c_str(), "w+");
+  if (file_ == nullptr) return;
+
+  // Map the file executable, so perf record sees the file in the mmap
+  // events for the process.
+  marker_size_ = sysconf(_SC_PAGESIZE);
+  marker_ = mmap(nullptr, marker_size_, PROT_READ | PROT_EXEC, MAP_PRIVATE,
+                 fileno(file_), 0);
+  if (marker_ == MAP_FAILED) marker_ = nullptr;
+
+  JitDumpHeader header;
+  header.magic = kJitDumpMagic;
+  header.version = kJitDumpVersion;
+  header.total_size = sizeof(JitDumpHeader);
+  header.elf_mach = EM_X86_64;
+  header.pad1 = 0;
+  header.pid = getpid();
+  header.timestamp = Timestamp();
+  header.flags = 0;
+  Write(&header, sizeof(header));
+  fflush(file_);
+}
+
+JitDump::~JitDump() {
+  if (marker_ != nullptr) munmap(marker_, marker_size_);
+  if (file_ != nullptr) fclose(file_);
+}
+
+void JitDump::Write(const void *data, size_t size) {
+  fwrite(data, 1, size, file_);
+}
+
+void JitDump::Installed(const Code &code, const CodeGenerator *generator) {
+  if (file_ == nullptr) return;
+  uint64_t timestamp = Timestamp();
+  uint64_t addr = reinterpret_cast<uint64_t>(code.begin());
+
+  // Write source line information for the code before the code itself.
+  if (generator != nullptr && !generator->lines().empty()) {
+    const auto &lines = generator->lines();
+    JitDebugInfo info;
+    info.header.id = kJitCodeDebugInfo;
+    info.header.total_size = sizeof(JitDebugInfo);
+    info.header.timestamp = timestamp;
+    info.code_addr = addr;
+    info.nr_entry = lines.size();
+    for (const auto &line : lines) {
+      info.header.total_size += sizeof(JitDebugEntry) + line.file.size() + 1;
+    }
+    Write(&info, sizeof(info));
+    for (const auto &line : lines) {
+      JitDebugEntry entry;
+      entry.addr = addr + generator->Translate(line.pos);
+      entry.line = line.line;
+      entry.discrim = 0;
+      Write(&entry, sizeof(entry));
+      Write(line.file.c_str(), line.file.size() + 1);
+    }
+  }
+
+  // Write unwind information for the code before the code itself. Perf
+  // places the .eh_frame section at the first 8-byte aligned address after
+  // the code, followed by the .eh_frame_hdr section with a binary search
+  // table for the FDE.
+  std::vector<byte> unwind;
+  uint64_t eh_frame = (code.size() + 7) & ~7;
+  if (generator != nullptr && generator->unwind_info() &&
+      generator->BuildUnwindInfo(&unwind, 0, eh_frame, true)) {
+    uint64_t hdr = eh_frame + unwind.size();
+    uint32_t fde = 4 + *reinterpret_cast<uint32_t *>(unwind.data());
+    uint8_t encodings[4] = {1, 0x1B, 0x03, 0x3B};
+    int32_t table[4] = {
+      static_cast<int32_t>(eh_frame - (hdr + 4)),  // pcrel .eh_frame
+      1,                                           // number of FDEs
+      static_cast<int32_t>(-hdr),                  // code start
+      static_cast<int32_t>(eh_frame + fde - hdr),  // FDE
+    };
+    unwind.insert(unwind.end(), encodings, encodings + sizeof(encodings));
+    const byte *entries = reinterpret_cast<const byte *>(table);
+    unwind.insert(unwind.end(), entries, entries + sizeof(table));
+
+    JitUnwindingInfo info;
+    int size = sizeof(JitUnwindingInfo) + unwind.size();
+    int padding = -size & 7;
+    info.header.id = kJitCodeUnwindingInfo;
+    info.header.total_size = size + padding;
+    info.header.timestamp = timestamp;
+    info.unwinding_size = unwind.size();
+    info.eh_frame_hdr_size = kEhFrameHdrSize;
+    info.mapped_size = unwind.size();
+    Write(&info, sizeof(info));
+    Write(unwind.data(), unwind.size());
+    uint64_t zero = 0;
+    Write(&zero, padding);
+  }
+
+  // Write code load record with name and code bytes.
+  std::string name = CodeName(code, generator);
+  JitCodeLoad load;
+  load.header.id = kJitCodeLoad;
+  load.header.total_size = sizeof(JitCodeLoad) + name.size() + 1 + code.size();
+  load.header.timestamp = timestamp;
+  load.pid = getpid();
+  load.tid = syscall(SYS_gettid);
+  load.vma = addr;
+  load.code_addr = addr;
+  load.code_size = code.size();
+  load.code_index = code_index_++;
+  Write(&load, sizeof(load));
+  Write(name.c_str(), name.size() + 1);
+  Write(code.begin(), code.size());
+  fflush(file_);
+}
+
+}  // namespace jit
+}  // namespace sling
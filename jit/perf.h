@@ -0,0 +1,72 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_PERF_H_
+#define JIT_PERF_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#include "jit/code.h"
+
+namespace sling {
+namespace jit {
+
+// Code observer that writes a perf map file with the address, size, and name
+// of all installed code, so Linux perf can attribute samples in generated code
+// to named functions. By default the map is written to /tmp/perf-<pid>.map,
+// which is where perf looks for it.
+class PerfMap : public CodeObserver {
+ public:
+  PerfMap();
+  explicit PerfMap(const std::string &filename);
+  ~PerfMap() override;
+
+  // Check if the map file could be opened.
+  bool ok() const { return file_ != nullptr; }
+
+  void Installed(const Code &code, const CodeGenerator *generator) override;
+
+ private:
+  FILE *file_;
+};
+
+// Code observer that writes a jitdump file for Linux perf. Unlike the perf
+// map, the jitdump file also contains the code bytes, source line
+// information, and unwind information, so perf can annotate generated code
+// even after it has been removed, and unwind through it when recording call
+// graphs with "--call-graph=dwarf". The file is written to
+// <directory>/jit-<pid>.dump and must be merged into a profile recorded with
+// "perf record -k mono" using "perf inject --jit".
+class JitDump : public CodeObserver {
+ public:
+  explicit JitDump(const std::string &directory = "/tmp");
+  ~JitDump() override;
+
+  // Check if the dump file could be opened.
+  bool ok() const { return file_ != nullptr; }
+
+  void Installed(const Code &code, const CodeGenerator *generator) override;
+
+ private:
+  // Write data to dump file.
+  void Write(const void *data, size_t size);
+
+  // Dump file.
+  FILE *file_ = nullptr;
+
+  // Executable mapping of the dump file, which tells perf record about the
+  // file.
+  void *marker_ = nullptr;
+  size_t marker_size_ = 0;
+
+  // Index of next code block.
+  uint64_t code_index_ = 0;
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_PERF_H_
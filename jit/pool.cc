@@ -0,0 +1,48 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jit/pool.h"
+
+#include <vector>
+
+namespace sling {
+namespace jit {
+
+namespace {
+
+// Idle assemblers for a thread. These are deallocated when the thread exits.
+struct AssemblerPool {
+  ~AssemblerPool() {
+    for (Assembler *assembler : idle) delete assembler;
+  }
+
+  std::vector<Assembler *> idle;
+};
+
+thread_local AssemblerPool pool;
+
+}  // namespace
+
+PooledAssembler::PooledAssembler(CpuFeatures features) {
+  if (pool.idle.empty()) {
+    assembler_ = new Assembler(nullptr, 0);
+  } else {
+    assembler_ = pool.idle.back();
+    pool.idle.pop_back();
+  }
+  assembler_->set_cpu_features(features);
+}
+
+PooledAssembler::~PooledAssembler() {
+  assembler_->Reset();
+  if (pool.idle.size() < kMaxPooled &&
+      assembler_->available_space() <= kMaxPooledBufferSize) {
+    pool.idle.push_back(assembler_);
+  } else {
+    delete assembler_;
+  }
+}
+
+}  // namespace jit
+}  // namespace sling
@@ -0,0 +1,45 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_POOL_H_
+#define JIT_POOL_H_
+
+#include "jit/assembler.h"
+
+namespace sling {
+namespace jit {
+
+// A pooled assembler borrows an assembler from a pool of assemblers owned by
+// the calling thread, so code can be generated at a high rate without
+// allocating new code buffers and tables for each piece of code. The
+// assembler is reset to its default configuration and returned to the pool
+// when the pooled assembler goes out of scope. Assemblers whose code buffer
+// has grown beyond the maximum pooled buffer size are deallocated instead of
+// being returned to the pool.
+class PooledAssembler {
+ public:
+  // Maximum number of idle assemblers in the pool for each thread.
+  static const int kMaxPooled = 8;
+
+  // Maximum code buffer size for assemblers returned to the pool.
+  static const int kMaxPooledBufferSize = 1 << 20;
+
+  // Borrow assembler for generating code for the CPU features in the feature
+  // set.
+  explicit PooledAssembler(CpuFeatures features = CpuFeatures::Supported());
+  ~PooledAssembler();
+
+  // Borrowed assembler.
+  Assembler *get() const { return assembler_; }
+  Assembler *operator->() const { return assembler_; }
+  Assembler &operator*() const { return *assembler_; }
+
+ private:
+  Assembler *assembler_;
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_POOL_H_
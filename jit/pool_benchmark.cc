@@ -0,0 +1,103 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Benchmark for memory allocations when generating code with pooled
+// assemblers. The allocation functions are replaced with counting versions,
+// and the number of allocations is reported for a number of compiles after
+// the pool has been warmed up.
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+
+#include "jit/heap.h"
+#include "jit/pool.h"
+
+// glibc allocation functions used by the counting allocator.
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+// Number of allocations since the start of the program.
+static std::atomic<int64_t> allocations(0);
+
+extern "C" void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size) {
+  allocations++;
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+extern "C" int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  allocations++;
+  *ptr = __libc_memalign(alignment, size);
+  return *ptr == nullptr ? ENOMEM : 0;
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size) {
+  allocations++;
+  return __libc_memalign(alignment, size);
+}
+
+extern "C" void free(void *ptr) { __libc_free(ptr); }
+
+void *operator new(size_t size) {
+  void *ptr = malloc(size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+using namespace sling::jit;
+
+// Generate a small function with a loop and a constant, and install it in
+// the code heap.
+static void Compile(CodeHeap *heap, int value) {
+  PooledAssembler masm;
+  Label loop;
+  masm->movq(rax, Immediate(0));
+  masm->movq(rcx, Immediate(value & 0xFF));
+  masm->bind(&loop);
+  masm->addq(rax, Operand(masm->AddConstant(&value, sizeof(value), 8)));
+  masm->decq(rcx);
+  masm->j(not_zero, &loop);
+  masm->ret(0);
+  Code code(heap, masm.get());
+}
+
+int main(int argc, char *argv[]) {
+  int compiles = argc > 1 ? atoi(argv[1]) : 100000;
+  CodeHeap heap;
+
+  // Warm up the pool, the code heap, and the tables of the assembler.
+  for (int i = 0; i < 1000; ++i) Compile(&heap, i);
+
+  int64_t before = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < compiles; ++i) Compile(&heap, i);
+  auto end = std::chrono::steady_clock::now();
+  int64_t count = allocations.load() - before;
+
+  double us = std::chrono::duration<double, std::micro>(end - start).count();
+  printf("compiles: %d\n", compiles);
+  printf("allocations: %lld (%.4f per compile)\n",
+         static_cast<long long>(count), static_cast<double>(count) / compiles);
+  printf("time per compile: %.3f us\n", us / compiles);
+  return 0;
+}
@@ -0,0 +1,158 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jit/service.h"
+
+#include <chrono>
+
+#include "jit/pool.h"
+
+namespace sling {
+namespace jit {
+
+bool CompileHandle::Wait() const {
+  if (!done()) {
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [this]() { return done(); });
+  }
+  return ready();
+}
+
+bool CompileHandle::Cancel() {
+  State expected = kPending;
+  if (!state_.compare_exchange_strong(expected, kRunning)) return false;
+  if (callback_) callback_(nullptr);
+  Finish(kFailed);
+  return true;
+}
+
+void CompileHandle::Finish(State state) {
+  std::lock_guard<std::mutex> lock(mu_);
+  state_.store(state, std::memory_order_release);
+  cv_.notify_all();
+}
+
+CompileService::CompileService(CodeHeap *heap, int workers,
+                               CpuFeatures features)
+    : heap_(heap), features_(features) {
+  for (int i = 0; i < workers; ++i) {
+    workers_.emplace_back(&CompileService::Worker, this);
+  }
+}
+
+CompileService::~CompileService() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (std::thread &worker : workers_) worker.join();
+
+  // Fail the requests that were never compiled.
+  while (!queue_.empty()) {
+    queue_.top().handle->Cancel();
+    queue_.pop();
+  }
+}
+
+std::shared_ptr<CompileHandle> CompileService::Submit(Generator generator,
+                                                      int priority,
+                                                      int tenant) {
+  return Submit(std::move(generator), nullptr, priority, tenant);
+}
+
+std::shared_ptr<CompileHandle> CompileService::Submit(Generator generator,
+                                                      Callback callback,
+                                                      int priority,
+                                                      int tenant) {
+  std::shared_ptr<CompileHandle> handle(new CompileHandle());
+  handle->callback_ = std::move(callback);
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    queue_.push({handle, std::move(generator), priority, tenant,
+                 next_sequence_++});
+  }
+  cv_.notify_one();
+  return handle;
+}
+
+void CompileService::SetBudget(int tenant, int64_t budget) {
+  std::lock_guard<std::mutex> lock(mu_);
+  Budget &b = budgets_[tenant];
+  b.limit = budget;
+  b.used = 0;
+}
+
+int64_t CompileService::used(int tenant) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto f = budgets_.find(tenant);
+  return f == budgets_.end() ? 0 : f->second.used;
+}
+
+int CompileService::pending() {
+  std::lock_guard<std::mutex> lock(mu_);
+  return queue_.size();
+}
+
+void CompileService::Worker() {
+  for (;;) {
+    Request request;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (stop_) return;
+      request = queue_.top();
+      queue_.pop();
+
+      // Reject request if the tenant has used up its budget.
+      auto f = budgets_.find(request.tenant);
+      if (f != budgets_.end()) {
+        const Budget &budget = f->second;
+        if (budget.limit != kUnlimited && budget.used >= budget.limit) {
+          lock.unlock();
+          request.handle->Cancel();
+          continue;
+        }
+      }
+    }
+
+    // Skip requests that have been cancelled.
+    CompileHandle::State expected = CompileHandle::kPending;
+    if (!request.handle->state_.compare_exchange_strong(
+            expected, CompileHandle::kRunning)) {
+      continue;
+    }
+    Compile(request);
+  }
+}
+
+void CompileService::Compile(const Request &request) {
+  auto start = std::chrono::steady_clock::now();
+  CompileHandle *handle = request.handle.get();
+  {
+    PooledAssembler masm(features_);
+    request.generator(masm.get());
+    handle->code_.reset(new Code(heap_, masm.get()));
+  }
+  auto end = std::chrono::steady_clock::now();
+  handle->compile_time_ =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+          .count();
+
+  // Charge compile time to tenant.
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto f = budgets_.find(request.tenant);
+    if (f != budgets_.end()) f->second.used += handle->compile_time_;
+  }
+
+  bool success = handle->code_->begin() != nullptr;
+  if (handle->callback_) {
+    handle->callback_(success ? handle->code_.get() : nullptr);
+  }
+  handle->Finish(success ? CompileHandle::kReady : CompileHandle::kFailed);
+}
+
+}  // namespace jit
+}  // namespace sling
@@ -0,0 +1,215 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_SERVICE_H_
+#define JIT_SERVICE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "jit/assembler.h"
+#include "jit/code.h"
+#include "jit/cpu.h"
+#include "jit/heap.h"
+
+namespace sling {
+namespace jit {
+
+class CompileService;
+
+// Handle for code compiled in the background by a compile service. The handle
+// is pending until the code has been compiled and installed, after which it
+// flips to ready. Checking whether the handle is ready only takes a single
+// atomic load, so callers can keep running a fallback implementation until
+// the compiled code becomes available.
+class CompileHandle {
+ public:
+  // State of compilation.
+  enum State {
+    kPending,   // waiting in the compile queue
+    kRunning,   // being compiled
+    kReady,     // code has been compiled and installed
+    kFailed,    // compilation was cancelled or rejected
+  };
+
+  // Current state of compilation.
+  State state() const { return state_.load(std::memory_order_acquire); }
+
+  // Check if the compiled code is ready.
+  bool ready() const { return state() == kReady; }
+
+  // Check if the compilation has finished, either successfully or not.
+  bool done() const { return state() >= kReady; }
+
+  // Compiled code, or null if the code is not ready.
+  const Code *code() const { return ready() ? code_.get() : nullptr; }
+
+  // Entry point for compiled code, or the fallback if the code is not ready.
+  template <typename F> F entry(F fallback) const {
+    return ready() ? reinterpret_cast<F>(code_->entry()) : fallback;
+  }
+
+  // Wait until the compilation has finished. Returns true if the code is
+  // ready.
+  bool Wait() const;
+
+  // Cancel compilation if it has not started yet. Returns true if the
+  // compilation was cancelled.
+  bool Cancel();
+
+  // Compile time in microseconds.
+  int64_t compile_time() const { return compile_time_; }
+
+ private:
+  // Move to new state and wake up waiters.
+  void Finish(State state);
+
+  // Compilation state.
+  std::atomic<State> state_{kPending};
+
+  // Compiled code. This is set before the handle becomes ready.
+  std::unique_ptr<Code> code_;
+
+  // Time used for compilation.
+  int64_t compile_time_ = 0;
+
+  // Completion callback.
+  std::function<void(const Code *code)> callback_;
+
+  // Mutex and condition variable for waiting for the compilation.
+  mutable std::mutex mu_;
+  mutable std::condition_variable cv_;
+
+  friend class CompileService;
+};
+
+// A compile service generates code in the background on a pool of worker
+// threads. Code generators are submitted to the service together with a
+// priority and a tenant. Each worker borrows a pooled assembler, runs the
+// generator, and installs the generated code into a shared code heap.
+//
+// Requests are compiled in priority order, and in submission order for
+// requests with the same priority. Each tenant can be given a budget for the
+// total time spent compiling code for the tenant. Once a tenant has used up
+// its budget, its remaining requests are rejected, so the callers keep using
+// their fallback implementations. The budget can be replenished with
+// SetBudget().
+class CompileService {
+ public:
+  // Code generator callback. The generator emits code for a function using
+  // the assembler.
+  typedef std::function<void(Assembler *masm)> Generator;
+
+  // Completion callback. This is called with the compiled code, or null if
+  // the compilation failed, before the handle for the request becomes done,
+  // so waiting for the handle also waits for the callback.
+  typedef std::function<void(const Code *code)> Callback;
+
+  // Tenant budget value for unlimited compile time.
+  static const int64_t kUnlimited = -1;
+
+  // Start compile service with a number of worker threads. The compiled code
+  // is installed in the code heap, and the code is generated for the CPU
+  // features in the feature set.
+  CompileService(CodeHeap *heap, int workers,
+                 CpuFeatures features = CpuFeatures::Supported());
+
+  // Stop the workers. Requests that have not been compiled yet are failed.
+  ~CompileService();
+
+  // Submit code generator for compilation. Requests with higher priority are
+  // compiled first. Returns a handle for the compiled code.
+  std::shared_ptr<CompileHandle> Submit(Generator generator,
+                                        int priority = 0,
+                                        int tenant = 0);
+
+  // Submit code generator for compilation with a callback, which is called
+  // on the worker thread when the compilation has finished, or by the thread
+  // cancelling the request.
+  std::shared_ptr<CompileHandle> Submit(Generator generator,
+                                        Callback callback,
+                                        int priority = 0,
+                                        int tenant = 0);
+
+  // Set the compile time budget in microseconds for tenant. This also resets
+  // the time used by the tenant. Tenants have unlimited budgets by default.
+  void SetBudget(int tenant, int64_t budget);
+
+  // Return compile time in microseconds used by tenant.
+  int64_t used(int tenant);
+
+  // Number of requests waiting to be compiled.
+  int pending();
+
+  // Code heap for compiled code.
+  CodeHeap *heap() const { return heap_; }
+
+ private:
+  // Compile request.
+  struct Request {
+    std::shared_ptr<CompileHandle> handle;
+    Generator generator;
+    int priority;
+    int tenant;
+    uint64_t sequence;
+  };
+
+  // Ordering of requests in the queue by priority and submission order.
+  struct Order {
+    bool operator()(const Request &a, const Request &b) const {
+      if (a.priority != b.priority) return a.priority < b.priority;
+      return a.sequence > b.sequence;
+    }
+  };
+
+  // Compile time budget for tenant.
+  struct Budget {
+    int64_t limit = kUnlimited;  // compile time budget
+    int64_t used = 0;            // compile time used
+  };
+
+  // Worker thread for compiling requests.
+  void Worker();
+
+  // Compile request and install the code.
+  void Compile(const Request &request);
+
+  // Code heap for compiled code.
+  CodeHeap *heap_;
+
+  // CPU features for compiled code.
+  CpuFeatures features_;
+
+  // Worker threads.
+  std::vector<std::thread> workers_;
+
+  // Requests waiting to be compiled.
+  std::priority_queue<Request, std::vector<Request>, Order> queue_;
+  uint64_t next_sequence_ = 0;
+
+  // Compile time budgets for tenants.
+  std::unordered_map<int, Budget> budgets_;
+
+  // Workers are stopped when the service is destroyed.
+  bool stop_ = false;
+
+  // Mutex for serializing access to the queue and budgets.
+  std::mutex mu_;
+
+  // Signal for waking up workers when requests are submitted.
+  std::condition_variable cv_;
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_SERVICE_H_
@@ -0,0 +1,110 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jit/tiering.h"
+
+namespace sling {
+namespace jit {
+
+// Argument registers preserved when the prologue starts compilation.
+static const Register kSavedRegisters[] = {rdi, rsi, rdx, rcx, r8, r9, rax};
+static const int kNumSavedRegisters = 7;
+static const int kNumSavedXMMRegisters = 8;
+
+TieredFunction::TieredFunction(CompileService *service, const void *generic,
+                               CompileService::Generator specialize,
+                               int32_t threshold, bool counted)
+    : service_(service),
+      specialize_(std::move(specialize)),
+      threshold_(threshold < 1 ? 1 : threshold),
+      entry_(const_cast<void *>(generic)) {
+  if (!counted) {
+    // Generate thunk that counts calls and jumps to the generic code.
+    Assembler masm(nullptr, 0);
+    EmitPrologue(&masm);
+    masm.movp(r11, generic);
+    masm.jmp(r11);
+    thunk_.reset(new Code(service->heap(), &masm));
+    entry_.store(thunk_->entry(), std::memory_order_release);
+  }
+}
+
+TieredFunction::~TieredFunction() {
+  std::shared_ptr<CompileHandle> handle;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    handle = handle_;
+  }
+  if (handle != nullptr && !handle->Cancel()) handle->Wait();
+}
+
+void TieredFunction::EmitPrologue(Assembler *masm) {
+  // Count call and check if the count has just reached the threshold. The
+  // counter is updated atomically, so exactly one call starts compilation.
+  Label skip;
+  masm->movp(r11, &calls_);
+  masm->movl(r10, Immediate(1));
+  masm->lock();
+  masm->xaddq(Operand(r11, 0), r10);
+  masm->cmpq(r10, Immediate(threshold_ - 1));
+  masm->j(not_equal, &skip);
+
+  // Save argument registers and call trigger. The stack is aligned after
+  // pushing an odd number of registers on function entry.
+  for (int i = 0; i < kNumSavedRegisters; ++i) {
+    masm->pushq(kSavedRegisters[i]);
+  }
+  masm->subq(rsp, Immediate(kNumSavedXMMRegisters * 16));
+  for (int i = 0; i < kNumSavedXMMRegisters; ++i) {
+    masm->movdqu(Operand(rsp, i * 16), XMMRegister::from_code(i));
+  }
+  masm->movp(rdi, this);
+  masm->movp(rax, reinterpret_cast<const void *>(&Trigger));
+  masm->call(rax);
+  for (int i = 0; i < kNumSavedXMMRegisters; ++i) {
+    masm->movdqu(XMMRegister::from_code(i), Operand(rsp, i * 16));
+  }
+  masm->addq(rsp, Immediate(kNumSavedXMMRegisters * 16));
+  for (int i = kNumSavedRegisters - 1; i >= 0; --i) {
+    masm->popq(kSavedRegisters[i]);
+  }
+  masm->bind(&skip);
+}
+
+void TieredFunction::Trigger(TieredFunction *function) {
+  Tier expected = kTier0;
+  if (!function->tier_.compare_exchange_strong(expected, kCompiling)) return;
+  std::lock_guard<std::mutex> lock(function->mu_);
+  function->handle_ = function->service_->Submit(
+      function->specialize_,
+      [function](const Code *code) { function->Install(code); },
+      function->priority_, function->tenant_);
+}
+
+void TieredFunction::Install(const Code *code) {
+  if (code == nullptr) {
+    tier_.store(kFailed, std::memory_order_release);
+    return;
+  }
+
+  // Switch callers to the new code and retire the thunk.
+  entry_.store(code->entry(), std::memory_order_release);
+  tier_.store(kTier1, std::memory_order_release);
+  std::lock_guard<std::mutex> lock(mu_);
+  if (thunk_ != nullptr) {
+    if (epochs_ != nullptr) {
+      epochs_->Retire(thunk_.release());
+    } else {
+      retired_.push_back(std::move(thunk_));
+    }
+  }
+}
+
+void TieredFunction::Reclaim() {
+  std::lock_guard<std::mutex> lock(mu_);
+  retired_.clear();
+}
+
+}  // namespace jit
+}  // namespace sling
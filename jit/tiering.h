@@ -0,0 +1,142 @@
+// Copyright 2017 Google Inc. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef JIT_TIERING_H_
+#define JIT_TIERING_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "jit/assembler.h"
+#include "jit/code.h"
+#include "jit/epoch.h"
+#include "jit/service.h"
+
+namespace sling {
+namespace jit {
+
+// A tiered function starts out running a generic tier 0 implementation and
+// switches to specialized tier 1 code once it has been called a number of
+// times. Calls go through an entry slot holding the address of the current
+// tier. The tier 0 code counts its calls in its prologue, and when the count
+// reaches the threshold, the specialized code is compiled in the background by
+// a compile service. When the tier 1 code has been installed, the entry slot is
+// updated with a single atomic store, so callers switch to the new code on
+// their next call.
+//
+// The replaced tier 0 code is retired, since other threads might still be
+// executing it. If the function has an epoch manager, the code is retired
+// to the epoch manager, and callers must call the function inside the epoch
+// manager. Otherwise, the code is not freed until Reclaim() is called.
+class TieredFunction {
+ public:
+  // Tier currently used by function.
+  enum Tier {
+    kTier0,      // running generic code
+    kCompiling,  // running generic code while compiling specialized code
+    kTier1,      // running specialized code
+    kFailed,     // running generic code after specialization failed
+  };
+
+  // Create tiered function. The generic implementation is used for tier 0,
+  // and the generator is used for compiling the specialized tier 1 code when
+  // the function has been called threshold times. The threshold must be at
+  // least 1, and smaller thresholds are raised to 1, i.e. the specialized
+  // code is compiled on the first call. Unless the generic implementation
+  // already counts calls with EmitPrologue(), a tier 0 thunk is generated
+  // which counts the calls and jumps to the generic code.
+  TieredFunction(CompileService *service, const void *generic,
+                 CompileService::Generator specialize, int32_t threshold,
+                 bool counted = false);
+
+  // Wait for pending compilation and free the code for the function.
+  ~TieredFunction();
+
+  // Set priority and tenant for compiling the specialized code.
+  void set_priority(int priority) { priority_ = priority; }
+  void set_tenant(int tenant) { tenant_ = tenant; }
+
+  // Set epoch manager for reclaiming replaced code.
+  void set_epochs(EpochManager *epochs) { epochs_ = epochs; }
+
+  // Entry point for the current tier.
+  void *entry() const { return entry_.load(std::memory_order_acquire); }
+
+  // Entry slot with the address of the current tier. Generated code can call
+  // the function indirectly through the slot.
+  void *const *slot() const {
+    return reinterpret_cast<void *const *>(&entry_);
+  }
+
+  // Current tier.
+  Tier tier() const { return tier_.load(std::memory_order_acquire); }
+
+  // Number of calls counted by tier 0 code.
+  int64_t calls() const { return __atomic_load_n(&calls_, __ATOMIC_RELAXED); }
+
+  // Emit code for counting calls at the entry of tier 0 code for the
+  // function. When the count reaches the threshold, compilation of the tier 1
+  // code is started. This must be emitted before the code changes the stack
+  // pointer. Only r10, r11, and the flags are clobbered; the argument registers
+  // and xmm0-xmm7 are preserved.
+  void EmitPrologue(Assembler *masm);
+
+  // Free retired code. The caller must make sure that no thread can still be
+  // executing the code that was replaced, e.g. by only calling this when all
+  // threads calling the function have passed a quiescent point after the
+  // function switched tier.
+  void Reclaim();
+
+ private:
+  // Start compilation of tier 1 code. This is called from the tier 0 code.
+  static void Trigger(TieredFunction *function);
+
+  // Install compiled tier 1 code.
+  void Install(const Code *code);
+
+  // Compile service for compiling the specialized code.
+  CompileService *service_;
+
+  // Code generator for specialized code.
+  CompileService::Generator specialize_;
+
+  // Number of calls before compiling the specialized code.
+  int32_t threshold_;
+
+  // Compile priority and tenant.
+  int priority_ = 0;
+  int tenant_ = 0;
+
+  // Epoch manager for reclaiming replaced code.
+  EpochManager *epochs_ = nullptr;
+
+  // Entry slot with the address of the current tier.
+  std::atomic<void *> entry_;
+
+  // Current tier.
+  std::atomic<Tier> tier_{kTier0};
+
+  // Call counter updated by tier 0 code.
+  int64_t calls_ = 0;
+
+  // Thunk for counting calls to the generic code.
+  std::unique_ptr<Code> thunk_;
+
+  // Handle for tier 1 code.
+  std::shared_ptr<CompileHandle> handle_;
+
+  // Replaced code that has not been freed yet.
+  std::vector<std::unique_ptr<Code>> retired_;
+
+  // Mutex for serializing access to the handle and retired code.
+  std::mutex mu_;
+};
+
+}  // namespace jit
+}  // namespace sling
+
+#endif  // JIT_TIERING_H_